@@ -1,7 +1,12 @@
 /* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
 
@@ -10,6 +15,82 @@
 
 #define UTF_INVALID 0xFFFD
 #define UTF_SIZ     4
+#define TEXT_SIZ    1024  /* longest run drw_text draws in one go */
+#define CP_UNKNOWN  0
+#define CP_PENDING  0xFE  /* fallback lookup queued, see fontworker */
+#define CP_NOFONT   0xFF  /* no installed font has the glyph */
+
+#define EXT_SIZ     512   /* cached text widths */
+#define EXT_BUCKETS 1024
+#define CLR_SIZ     256   /* cached colors, power of two */
+#define RUN_BUCKETS 256
+#define GLYPH_SIZ   512   /* initial glyph batch capacity */
+
+struct CpFont {
+	long cp;
+	unsigned char font;
+};
+
+struct ExtEntry {
+	char *text;
+	unsigned long hash;
+	Fnt *fonts;
+	unsigned int w;
+	struct ExtEntry *hnext;       /* bucket chain */
+	struct ExtEntry *prev, *next; /* recency, most recent first */
+};
+
+struct ClrEntry {
+	char *name;
+	unsigned int alpha;
+	Clr clr;
+};
+
+struct TextRun {
+	char *text;
+	unsigned long hash, fg, bg;
+	Fnt *fonts;
+	unsigned int w, h, lpad;
+	Pixmap pm;
+	struct TextRun *hnext;
+	struct TextRun *prev, *next;
+};
+
+struct RunCache {
+	struct TextRun *bucket[RUN_BUCKETS];
+	struct TextRun *head, *tail;
+	size_t bytes, max;
+};
+
+struct FontJob {
+	long cp;
+	Fnt *fonts;        /* fontset the lookup was made for */
+	FcPattern *pat;    /* prepared in the main thread, owned by the worker */
+	FcPattern *match;  /* result, owned by whoever opens it */
+	struct FontJob *next;
+};
+
+struct FontWorker {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct FontJob *todo, *done;
+	int started, quit;
+	int pipe[2];       /* a byte is written per finished job */
+};
+
+struct GlyphBatch {
+	XftGlyphFontSpec *specs;
+	unsigned int n, size;
+	XftColor clr;
+	int x0, y0, x1, y1; /* area the pending glyphs are drawn into */
+};
+
+struct ExtCache {
+	struct ExtEntry *bucket[EXT_BUCKETS];
+	struct ExtEntry *head, *tail;
+	unsigned int n;
+};
 
 static const unsigned char utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static const unsigned char utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
@@ -44,6 +125,10 @@ utf8decode(const char *c, long *u, size_t clen)
 	*u = UTF_INVALID;
 	if (!clen)
 		return 0;
+	if (!((unsigned char)c[0] & 0x80)) {
+		*u = c[0];
+		return 1;
+	}
 	udecoded = utf8decodebyte(c[0], &len);
 	if (!BETWEEN(len, 1, UTF_SIZ))
 		return 1;
@@ -60,6 +145,219 @@ utf8decode(const char *c, long *u, size_t clen)
 	return len;
 }
 
+static void
+extcache_clear(Drw *drw)
+{
+	struct ExtEntry *e, *next;
+
+	if (!drw->ext)
+		return;
+	for (e = drw->ext->head; e; e = next) {
+		next = e->next;
+		free(e->text);
+		free(e);
+	}
+	memset(drw->ext, 0, sizeof(struct ExtCache));
+}
+
+static unsigned long
+exthash(const char *s)
+{
+	unsigned long h = 5381;
+
+	while (*s)
+		h = h * 33 ^ (unsigned char)*s++;
+	return h;
+}
+
+static void
+extcache_unlink(struct ExtCache *ec, struct ExtEntry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		ec->head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		ec->tail = e->prev;
+}
+
+static void
+extcache_push(struct ExtCache *ec, struct ExtEntry *e)
+{
+	e->prev = NULL;
+	e->next = ec->head;
+	if (ec->head)
+		ec->head->prev = e;
+	else
+		ec->tail = e;
+	ec->head = e;
+}
+
+static void
+runcache_drop(Drw *drw, struct TextRun *r)
+{
+	struct RunCache *rc = drw->runs;
+	struct TextRun **pr;
+
+	if (r->prev)
+		r->prev->next = r->next;
+	else
+		rc->head = r->next;
+	if (r->next)
+		r->next->prev = r->prev;
+	else
+		rc->tail = r->prev;
+	for (pr = &rc->bucket[r->hash % RUN_BUCKETS]; *pr != r; pr = &(*pr)->hnext)
+		; /* NOP */
+	*pr = r->hnext;
+	rc->bytes -= (size_t)r->w * r->h * 4;
+	XFreePixmap(drw->dpy, r->pm);
+	free(r->text);
+	free(r);
+}
+
+static void
+runcache_clear(Drw *drw)
+{
+	while (drw->runs && drw->runs->head)
+		runcache_drop(drw, drw->runs->head);
+}
+
+/* Finds a run rendered earlier with the same text, colors, fontset and
+ * geometry and makes it the most recently used one. */
+static struct TextRun *
+runcache_get(Drw *drw, unsigned long h, const char *text, unsigned int w,
+             unsigned int ht, unsigned int lpad, unsigned long fg, unsigned long bg)
+{
+	struct RunCache *rc = drw->runs;
+	struct TextRun *r;
+
+	for (r = rc->bucket[h % RUN_BUCKETS]; r; r = r->hnext)
+		if (r->hash == h && r->w == w && r->h == ht && r->lpad == lpad && r->fg == fg
+		    && r->bg == bg && r->fonts == drw->fonts && !strcmp(r->text, text))
+			break;
+	if (!r || r == rc->head)
+		return r;
+	r->prev->next = r->next;
+	if (r->next)
+		r->next->prev = r->prev;
+	else
+		rc->tail = r->prev;
+	r->prev = NULL;
+	r->next = rc->head;
+	rc->head->prev = r;
+	rc->head = r;
+	return r;
+}
+
+/* Keeps a copy of the run just drawn at x, y, evicting the least recently
+ * used runs to stay below the configured number of bytes. Runs that do not
+ * lie entirely inside the current buffer are not kept. */
+static void
+runcache_put(Drw *drw, unsigned long h, const char *text, int x, int y, unsigned int w,
+             unsigned int ht, unsigned int lpad, unsigned long fg, unsigned long bg)
+{
+	struct RunCache *rc = drw->runs;
+	struct TextRun *r;
+	size_t bytes = (size_t)w * ht * 4;
+
+	if (bytes > rc->max / 4)
+		return;
+	/* pixels outside the buffer are undefined, a hit would blit them */
+	if (x < 0 || y < 0 || x + w > drw->buf->w || y + ht > drw->buf->h)
+		return;
+	while (rc->tail && rc->bytes + bytes > rc->max)
+		runcache_drop(drw, rc->tail);
+
+	r = ecalloc(1, sizeof(struct TextRun));
+	r->text = strdup(text);
+	r->hash = h;
+	r->fg = fg;
+	r->bg = bg;
+	r->fonts = drw->fonts;
+	r->w = w;
+	r->h = ht;
+	r->lpad = lpad;
+	r->pm = XCreatePixmap(drw->dpy, drw->root, w, ht, drw->depth);
+	drw_flush(drw);
+	XCopyArea(drw->dpy, drw->buf->drawable, r->pm, drw->gc, x, y, w, ht, 0, 0);
+	r->hnext = rc->bucket[h % RUN_BUCKETS];
+	rc->bucket[h % RUN_BUCKETS] = r;
+	r->next = rc->head;
+	if (rc->head)
+		rc->head->prev = r;
+	else
+		rc->tail = r;
+	rc->head = r;
+	rc->bytes += bytes;
+}
+
+/* Fallback fonts are matched on this thread so a cold fontconfig cache
+ * never stalls the event loop. It only runs FcFontMatch; opening the
+ * matched font is left to drw_fontset_poll() in the main thread. */
+static void *
+fontworker(void *arg)
+{
+	struct FontWorker *fw = arg;
+	struct FontJob *j;
+	FcResult result;
+
+	pthread_mutex_lock(&fw->lock);
+	while (!fw->quit) {
+		if (!(j = fw->todo)) {
+			pthread_cond_wait(&fw->cond, &fw->lock);
+			continue;
+		}
+		fw->todo = j->next;
+		pthread_mutex_unlock(&fw->lock);
+
+		j->match = FcFontMatch(NULL, j->pat, &result);
+		FcPatternDestroy(j->pat);
+		j->pat = NULL;
+
+		pthread_mutex_lock(&fw->lock);
+		j->next = fw->done;
+		fw->done = j;
+		while (write(fw->pipe[1], "", 1) < 0 && errno == EINTR)
+			; /* NOP */
+	}
+	pthread_mutex_unlock(&fw->lock);
+	return NULL;
+}
+
+static void
+fontworker_free(struct FontWorker *fw)
+{
+	struct FontJob *j, *lists[2];
+	int i;
+
+	if (fw->started) {
+		pthread_mutex_lock(&fw->lock);
+		fw->quit = 1;
+		pthread_cond_signal(&fw->cond);
+		pthread_mutex_unlock(&fw->lock);
+		pthread_join(fw->thread, NULL);
+	}
+	lists[0] = fw->todo;
+	lists[1] = fw->done;
+	for (i = 0; i < 2; i++)
+		while ((j = lists[i])) {
+			lists[i] = j->next;
+			if (j->pat)
+				FcPatternDestroy(j->pat);
+			if (j->match)
+				FcPatternDestroy(j->match);
+			free(j);
+		}
+	close(fw->pipe[0]);
+	close(fw->pipe[1]);
+	pthread_cond_destroy(&fw->cond);
+	pthread_mutex_destroy(&fw->lock);
+	free(fw);
+}
+
 Drw *
 drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h, Visual *visual, unsigned int depth, Colormap cmap)
 {
@@ -73,9 +371,18 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 	drw->visual = visual;
 	drw->depth = depth;
 	drw->cmap = cmap;
-	drw->drawable = XCreatePixmap(dpy, root, w, h, depth);
-	drw->gc = XCreateGC(dpy, drw->drawable, 0, NULL);
+	drw->buf = drw->own = drw_buf_create(drw, w, h);
+	drw->gc = XCreateGC(dpy, drw->buf->drawable, 0, NULL);
 	XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
+	drw->batch = ecalloc(1, sizeof(struct GlyphBatch));
+
+	drw->worker = ecalloc(1, sizeof(struct FontWorker));
+	if (pipe(drw->worker->pipe) < 0)
+		die("pipe:");
+	fcntl(drw->worker->pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(drw->worker->pipe[1], F_SETFL, O_NONBLOCK);
+	pthread_mutex_init(&drw->worker->lock, NULL);
+	pthread_cond_init(&drw->worker->cond, NULL);
 
 	return drw;
 }
@@ -88,20 +395,83 @@ drw_resize(Drw *drw, unsigned int w, unsigned int h)
 
 	drw->w = w;
 	drw->h = h;
-	if (drw->drawable)
-		XFreePixmap(drw->dpy, drw->drawable);
-	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, drw->depth);
+	drw_buf_resize(drw, drw->own, w, h);
 }
 
 void
 drw_free(Drw *drw)
 {
-	XFreePixmap(drw->dpy, drw->drawable);
+	size_t i;
+
+	drw_flush(drw);
+	fontworker_free(drw->worker);
+	drw->buf = NULL;
+	drw_buf_free(drw, drw->own);
 	XFreeGC(drw->dpy, drw->gc);
+	free(drw->batch->specs);
+	free(drw->batch);
     drw_fontset_free(drw->fonts);
+	free(drw->bmpfont);
+	free(drw->cpfont);
+	extcache_clear(drw);
+	free(drw->ext);
+	runcache_clear(drw);
+	free(drw->runs);
+	if (drw->clrs) {
+		for (i = 0; i < CLR_SIZ; i++)
+			if (drw->clrs[i].name) {
+				XftColorFree(drw->dpy, drw->visual, drw->cmap, &drw->clrs[i].clr);
+				free(drw->clrs[i].name);
+			}
+		free(drw->clrs);
+	}
 	free(drw);
 }
 
+Buf *
+drw_buf_create(Drw *drw, unsigned int w, unsigned int h)
+{
+	Buf *buf;
+
+	if (!drw)
+		return NULL;
+
+	buf = ecalloc(1, sizeof(Buf));
+	buf->w = w;
+	buf->h = h;
+	buf->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, drw->depth);
+	buf->xftdraw = XftDrawCreate(drw->dpy, buf->drawable, drw->visual, drw->cmap);
+	return buf;
+}
+
+/* Reallocates only when the size actually changes. */
+void
+drw_buf_resize(Drw *drw, Buf *buf, unsigned int w, unsigned int h)
+{
+	if (!drw || !buf || (buf->w == w && buf->h == h))
+		return;
+
+	if (drw->buf == buf)
+		drw_flush(drw);
+	XFreePixmap(drw->dpy, buf->drawable);
+	buf->w = w;
+	buf->h = h;
+	buf->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, drw->depth);
+	XftDrawChange(buf->xftdraw, buf->drawable);
+}
+
+void
+drw_buf_free(Drw *drw, Buf *buf)
+{
+	if (!drw || !buf)
+		return;
+	if (drw->buf == buf)
+		drw_setbuf(drw, NULL);
+	XftDrawDestroy(buf->xftdraw);
+	XFreePixmap(drw->dpy, buf->drawable);
+	free(buf);
+}
+
 /* This function is an implementation detail. Library users should use
  * drw_fontset_create instead.
  */
@@ -171,7 +541,8 @@ drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 			ret = cur;
 		}
 	}
-	return (drw->fonts = ret);
+	drw_setfontset(drw, ret);
+	return ret;
 }
 
 void
@@ -196,6 +567,38 @@ drw_clr_create(Drw *drw, Clr *dest, const char *clrname, unsigned int alpha)
 	dest->pixel = (dest->pixel & 0x00ffffffU) | (alpha << 24);
 }
 
+/* Colors requested by name at draw time, e.g. from status text, are kept in
+ * a direct-mapped table keyed by (name, alpha). A colliding entry is freed
+ * before it is replaced, so the table never holds more than CLR_SIZ colors. */
+const Clr *
+drw_clr_get(Drw *drw, const char *clrname, unsigned int alpha)
+{
+	struct ClrEntry *e;
+	unsigned long h = alpha;
+	const char *c;
+
+	if (!drw || !clrname)
+		return NULL;
+
+	for (c = clrname; *c; c++)
+		h = h * 33 ^ (unsigned char)*c;
+	if (!drw->clrs)
+		drw->clrs = ecalloc(CLR_SIZ, sizeof(struct ClrEntry));
+	e = &drw->clrs[h & (CLR_SIZ - 1)];
+	if (e->name && e->alpha == alpha && !strcmp(e->name, clrname))
+		return &e->clr;
+
+	if (e->name) {
+		XftColorFree(drw->dpy, drw->visual, drw->cmap, &e->clr);
+		free(e->name);
+		e->name = NULL;
+	}
+	drw_clr_create(drw, &e->clr, clrname, alpha);
+	e->name = strdup(clrname);
+	e->alpha = alpha;
+	return &e->clr;
+}
+
 /* Wrapper to create color schemes. The caller has to call free(3) on the
  * returned color scheme when done using it. */
 Clr *
@@ -213,11 +616,218 @@ drw_scm_create(Drw *drw, const char *clrnames[], const unsigned int alphas[], si
 	return ret;
 }
 
+static void
+cpcache_clear(Drw *drw)
+{
+	if (drw->bmpfont)
+		memset(drw->bmpfont, CP_UNKNOWN, 0x10000);
+	if (drw->cpfont)
+		memset(drw->cpfont, 0, drw->cpfontsize * sizeof(struct CpFont));
+	drw->cpfontused = 0;
+}
+
+static unsigned char *
+cpcache_slot(Drw *drw, long cp, int insert)
+{
+	size_t i, j, oldsize;
+	struct CpFont *old;
+
+	if (cp < 0x10000) {
+		if (!drw->bmpfont)
+			drw->bmpfont = ecalloc(0x10000, 1);
+		return &drw->bmpfont[cp];
+	}
+	if (insert && (drw->cpfontused + 1) * 2 > drw->cpfontsize) {
+		old = drw->cpfont;
+		oldsize = drw->cpfontsize;
+		drw->cpfontsize = oldsize ? oldsize * 2 : 64;
+		drw->cpfont = ecalloc(drw->cpfontsize, sizeof(struct CpFont));
+		for (i = 0; i < oldsize; i++) {
+			if (!old[i].font)
+				continue;
+			for (j = old[i].cp & (drw->cpfontsize - 1); drw->cpfont[j].font;
+			     j = (j + 1) & (drw->cpfontsize - 1))
+				; /* NOP */
+			drw->cpfont[j] = old[i];
+		}
+		free(old);
+	}
+	if (!drw->cpfontsize)
+		return NULL;
+	for (i = cp & (drw->cpfontsize - 1); drw->cpfont[i].font; i = (i + 1) & (drw->cpfontsize - 1))
+		if (drw->cpfont[i].cp == cp)
+			return &drw->cpfont[i].font;
+	if (!insert)
+		return NULL;
+	drw->cpfontused++;
+	drw->cpfont[i].cp = cp;
+	return &drw->cpfont[i].font;
+}
+
+/* Hands the search for a font covering cp to the worker thread. */
+static void
+fontworker_queue(Drw *drw, long cp)
+{
+	struct FontWorker *fw = drw->worker;
+	struct FontJob *j;
+	FcCharSet *fccharset;
+
+	if (!drw->fonts->pattern) {
+		/* Refer to the comment in xfont_create for more information. */
+		die("the first font in the cache must be loaded from a font string.");
+	}
+
+	j = ecalloc(1, sizeof(struct FontJob));
+	j->cp = cp;
+	j->fonts = drw->fonts;
+
+	fccharset = FcCharSetCreate();
+	FcCharSetAddChar(fccharset, cp);
+
+	j->pat = FcPatternDuplicate(drw->fonts->pattern);
+	FcPatternAddCharSet(j->pat, FC_CHARSET, fccharset);
+	FcPatternAddBool(j->pat, FC_SCALABLE, FcTrue);
+	FcPatternAddBool(j->pat, FC_COLOR, FcFalse);
+	/* same order as XftFontMatch: the user's fonts.conf rules first, then the
+	 * Xft defaults, which need the display; only FcFontMatch is left for
+	 * the worker */
+	FcConfigSubstitute(NULL, j->pat, FcMatchPattern);
+	XftDefaultSubstitute(drw->dpy, drw->screen, j->pat);
+
+	FcCharSetDestroy(fccharset);
+
+	pthread_mutex_lock(&fw->lock);
+	if (!fw->started) {
+		if (pthread_create(&fw->thread, NULL, fontworker, fw))
+			die("pthread_create:");
+		fw->started = 1;
+	}
+	j->next = fw->todo;
+	fw->todo = j;
+	pthread_cond_signal(&fw->cond);
+	pthread_mutex_unlock(&fw->lock);
+}
+
+/* Returns the font drw_text() draws codepoint cp with: the first font of the
+ * set that has the glyph, or the first font as placeholder while a fallback
+ * is looked for and when nothing can render it. Answers are cached until the
+ * fontset changes, including the negative ones. */
+static Fnt *
+xfont_lookup(Drw *drw, long cp)
+{
+	Fnt *cur;
+	unsigned char *slot;
+	unsigned int n;
+
+	if ((slot = cpcache_slot(drw, cp, 0)) && *slot != CP_UNKNOWN) {
+		if (*slot == CP_NOFONT || *slot == CP_PENDING)
+			return drw->fonts;
+		for (cur = drw->fonts, n = *slot - 1; cur && n; cur = cur->next, n--)
+			; /* NOP */
+		if (cur)
+			return cur;
+	}
+
+	for (cur = drw->fonts, n = 0; cur; cur = cur->next, n++)
+		if (XftCharExists(drw->dpy, cur->xfont, cp))
+			break;
+	if (!cur)
+		fontworker_queue(drw, cp);
+
+	if ((slot = cpcache_slot(drw, cp, 1)))
+		*slot = !cur ? CP_PENDING : n + 1 < CP_PENDING ? n + 1 : CP_UNKNOWN;
+	return cur ? cur : drw->fonts;
+}
+
+/* Opens the fallback fonts the worker found. Returns nonzero if any
+ * codepoint changed font, in which case everything drawn or measured with
+ * the placeholder is stale and has to be redrawn by the caller. */
+int
+drw_fontset_poll(Drw *drw)
+{
+	struct FontWorker *fw;
+	struct FontJob *j, *done;
+	Fnt *cur, *last = NULL;
+	unsigned char *slot;
+	unsigned int n;
+	char c[64];
+	int changed = 0;
+
+	if (!drw || !(fw = drw->worker))
+		return 0;
+	while (read(fw->pipe[0], c, sizeof c) > 0)
+		; /* NOP */
+	pthread_mutex_lock(&fw->lock);
+	done = fw->done;
+	fw->done = NULL;
+	pthread_mutex_unlock(&fw->lock);
+
+	while ((j = done)) {
+		done = j->next;
+		if (j->fonts == drw->fonts && (slot = cpcache_slot(drw, j->cp, 1)) && *slot == CP_PENDING) {
+			/* a font opened for an earlier job may cover it already */
+			for (cur = drw->fonts, n = 0; cur; last = cur, cur = cur->next, n++)
+				if (XftCharExists(drw->dpy, cur->xfont, j->cp))
+					break;
+			if (!cur && j->match) {
+				if ((cur = xfont_create(drw, NULL, j->match)))
+					j->match = NULL; /* owned by the font now */
+				if (cur && XftCharExists(drw->dpy, cur->xfont, j->cp)) {
+					last->next = cur;
+				} else {
+					xfont_free(cur);
+					cur = NULL;
+				}
+			}
+			*slot = !cur ? CP_NOFONT : n + 1 < CP_PENDING ? n + 1 : CP_UNKNOWN;
+			changed = 1;
+		}
+		if (j->match)
+			FcPatternDestroy(j->match);
+		free(j);
+	}
+	if (changed) {
+		extcache_clear(drw);
+		runcache_clear(drw);
+	}
+	return changed;
+}
+
+/* Becomes readable when drw_fontset_poll() has work to do. */
+int
+drw_fontset_fd(Drw *drw)
+{
+	return drw && drw->worker ? drw->worker->pipe[0] : -1;
+}
+
 void
 drw_setfontset(Drw *drw, Fnt *set)
 {
-	if (drw)
-		drw->fonts = set;
+	FcChar32 c;
+
+	if (!drw)
+		return;
+	drw->fonts = set;
+	/* lets drw_text take printable ASCII runs without per-codepoint lookups */
+	for (drw->asciifont = set != NULL, c = ' '; drw->asciifont && c <= '~'; c++)
+		drw->asciifont = XftCharExists(drw->dpy, set->xfont, c);
+	cpcache_clear(drw);
+	extcache_clear(drw);
+	runcache_clear(drw);
+}
+
+/* Sets how many bytes of rendered text drw_text may keep around, 0 turns
+ * the cache off. */
+void
+drw_settextcache(Drw *drw, size_t max)
+{
+	if (!drw)
+		return;
+	if (!drw->runs)
+		drw->runs = ecalloc(1, sizeof(struct RunCache));
+	drw->runs->max = max;
+	while (drw->runs->tail && drw->runs->bytes > max)
+		runcache_drop(drw, drw->runs->tail);
 }
 
 void
@@ -227,45 +837,170 @@ drw_setscheme(Drw *drw, Clr *scm)
 		drw->scheme = scm;
 }
 
+/* Directs drawing to buf, or back to drw's own pixmap if buf is NULL. */
+void
+drw_setbuf(Drw *drw, Buf *buf)
+{
+	if (!drw)
+		return;
+	if (drw->buf != (buf ? buf : drw->own))
+		drw_flush(drw);
+	drw->buf = buf ? buf : drw->own;
+}
+
+static void
+setfg(Drw *drw, unsigned long pixel)
+{
+	if (drw->gcfgset && drw->gcfg == pixel)
+		return;
+	XSetForeground(drw->dpy, drw->gc, pixel);
+	drw->gcfg = pixel;
+	drw->gcfgset = 1;
+}
+
+void
+drw_flush(Drw *drw)
+{
+	struct GlyphBatch *b;
+
+	if (!drw || !drw->buf || !(b = drw->batch)->n)
+		return;
+	XftDrawGlyphFontSpec(drw->buf->xftdraw, &b->clr, b->specs, b->n);
+	b->n = 0;
+}
+
+/* Pending glyphs must reach the buffer before anything else paints over
+ * the area they are drawn into. */
+static void
+batch_clip(Drw *drw, int x, int y, unsigned int w, unsigned int h)
+{
+	struct GlyphBatch *b = drw->batch;
+
+	if (b->n && x < b->x1 && b->x0 < x + (int)w && y < b->y1 && b->y0 < y + (int)h)
+		drw_flush(drw);
+}
+
+/* Queues the glyphs of text for drawing at x, y (the baseline) within the
+ * cell cx, cy, cw, ch. Consecutive runs in one color are sent together. */
+static void
+batch_add(Drw *drw, const XftColor *clr, Fnt *font, int x, int y, const char *text, size_t len,
+          int cx, int cy, unsigned int cw, unsigned int ch)
+{
+	struct GlyphBatch *b = drw->batch;
+	XGlyphInfo ext;
+	FT_UInt glyph;
+	size_t i, clen;
+	long cp;
+
+	if (b->n && b->clr.pixel != clr->pixel)
+		drw_flush(drw);
+	if (!b->n) {
+		b->clr = *clr;
+		b->x0 = cx;
+		b->y0 = cy;
+		b->x1 = cx + cw;
+		b->y1 = cy + ch;
+	} else {
+		b->x0 = MIN(b->x0, cx);
+		b->y0 = MIN(b->y0, cy);
+		b->x1 = MAX(b->x1, cx + (int)cw);
+		b->y1 = MAX(b->y1, cy + (int)ch);
+	}
+	for (i = 0; i < len; i += clen) {
+		if (!(clen = utf8decode(text + i, &cp, len - i)))
+			break;
+		if (b->n == b->size) {
+			b->size = b->size ? b->size * 2 : GLYPH_SIZ;
+			if (!(b->specs = realloc(b->specs, b->size * sizeof(XftGlyphFontSpec))))
+				die("realloc:");
+		}
+		glyph = XftCharIndex(drw->dpy, font->xfont, cp);
+		b->specs[b->n].font = font->xfont;
+		b->specs[b->n].glyph = glyph;
+		b->specs[b->n].x = x;
+		b->specs[b->n].y = y;
+		b->n++;
+		XftGlyphExtents(drw->dpy, font->xfont, &glyph, 1, &ext);
+		x += ext.xOff;
+	}
+}
+
 void
 drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert)
 {
 	if (!drw || !drw->scheme)
 		return;
-	XSetForeground(drw->dpy, drw->gc, invert ? drw->scheme[ColBg].pixel : drw->scheme[ColFg].pixel);
+	batch_clip(drw, x, y, w, h);
+	setfg(drw, invert ? drw->scheme[ColBg].pixel : drw->scheme[ColFg].pixel);
 	if (filled)
-		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
+		XFillRectangle(drw->dpy, drw->buf->drawable, drw->gc, x, y, w, h);
 	else
-		XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
+		XDrawRectangle(drw->dpy, drw->buf->drawable, drw->gc, x, y, w - 1, h - 1);
+}
+
+/* Returns the longest prefix of s, at most max bytes and cut on a codepoint
+ * boundary, that is no wider than maxw. Binary search over the boundaries
+ * keeps this at O(log n) extent queries. */
+static size_t
+utf8fit(Fnt *font, const char *s, size_t len, size_t max, unsigned int maxw, unsigned int *ew)
+{
+	size_t b[TEXT_SIZ], nb = 0, i, lo, hi, mid, fit = 0;
+	unsigned int w = 0;
+
+	*ew = 0;
+	for (i = 1; i <= MIN(len, MIN(max, TEXT_SIZ)); i++)
+		if (i == len || (s[i] & 0xC0) != 0x80)
+			b[nb++] = i;
+	for (lo = 0, hi = nb; lo < hi;) {
+		mid = lo + (hi - lo) / 2;
+		drw_font_getexts(font, s, b[mid], &w, NULL);
+		if (w <= maxw) {
+			fit = b[mid];
+			*ew = w;
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return fit;
 }
 
 int
 drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
 {
-	char buf[1024];
-	int ty;
-	unsigned int ew;
-	XftDraw *d = NULL;
+	char buf[TEXT_SIZ];
+	int ty, trunc = 0;
+	unsigned int ew, ellw = 0;
 	Fnt *usedfont, *curfont, *nextfont;
 	size_t i, len;
 	int utf8strlen, utf8charlen, render = x || y || w || h;
 	long utf8codepoint = 0;
-	const char *utf8str;
-	FcCharSet *fccharset;
-	FcPattern *fcpattern;
-	FcPattern *match;
-	XftResult result;
-	int charexists = 0;
+	const char *utf8str, *str = text;
+	int x0 = x;
+	unsigned int w0 = w;
+	unsigned long hash = 0, fg = 0, bg = 0;
+	struct TextRun *run;
 
 	if (!drw || (render && !drw->scheme) || !text || !drw->fonts)
 		return 0;
 
+	if (render && w && h && drw->runs && drw->runs->max) {
+		hash = exthash(text);
+		fg = drw->scheme[invert ? ColBg : ColFg].pixel;
+		bg = drw->scheme[invert ? ColFg : ColBg].pixel;
+		if ((run = runcache_get(drw, hash, text, w, h, lpad, fg, bg))) {
+			batch_clip(drw, x, y, w, h);
+			XCopyArea(drw->dpy, run->pm, drw->buf->drawable, drw->gc, 0, 0, w, h, x, y);
+			return x + w;
+		}
+	}
+
 	if (!render) {
 		w = ~w;
 	} else {
-		XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
-		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-		d = XftDrawCreate(drw->dpy, drw->drawable, drw->visual, drw->cmap);
+		batch_clip(drw, x, y, w, h);
+		setfg(drw, drw->scheme[invert ? ColFg : ColBg].pixel);
+		XFillRectangle(drw->dpy, drw->buf->drawable, drw->gc, x, y, w, h);
 		x += lpad;
 		w -= lpad;
 	}
@@ -276,94 +1011,61 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 		utf8str = text;
 		nextfont = NULL;
 		while (*text) {
-			utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
-			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
-				charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
-				if (charexists) {
-					if (curfont == usedfont) {
-						utf8strlen += utf8charlen;
-						text += utf8charlen;
-					} else {
-						nextfont = curfont;
-					}
+			/* printable ASCII the primary font covers goes in one step */
+			if (usedfont == drw->fonts && drw->asciifont) {
+				for (i = 0; (unsigned char)text[i] >= ' ' && (unsigned char)text[i] <= '~'; i++)
+					; /* NOP */
+				utf8strlen += i;
+				text += i;
+				if (!*text)
 					break;
-				}
 			}
-
-			if (!charexists || nextfont)
+			utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
+			if ((curfont = xfont_lookup(drw, utf8codepoint)) != usedfont) {
+				nextfont = curfont;
 				break;
-			else
-				charexists = 0;
+			}
+			utf8strlen += utf8charlen;
+			text += utf8charlen;
 		}
 
 		if (utf8strlen) {
 			drw_font_getexts(usedfont, utf8str, utf8strlen, &ew, NULL);
-			/* shorten text if necessary */
-			for (len = MIN(utf8strlen, sizeof(buf) - 1); len && ew > w; len--)
-				drw_font_getexts(usedfont, utf8str, len, &ew, NULL);
+			len = utf8strlen;
+			memcpy(buf, utf8str, MIN(len, sizeof(buf) - 1));
+			/* shorten text if necessary, ending it in an ellipsis */
+			if (ew > w || len > sizeof(buf) - 1) {
+				trunc = 1;
+				drw_font_getexts(usedfont, "...", 3, &ellw, NULL);
+				if (ellw <= w) {
+					len = utf8fit(usedfont, utf8str, utf8strlen, sizeof(buf) - 4, w - ellw, &ew);
+					memcpy(buf + len, "...", 3);
+					len += 3;
+					ew += ellw;
+				} else {
+					len = 0;
+				}
+			}
 
 			if (len) {
-				memcpy(buf, utf8str, len);
 				buf[len] = '\0';
-				if (len < utf8strlen)
-					for (i = len; i && i > len - 3; buf[--i] = '.')
-						; /* NOP */
 
 				if (render) {
 					ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
-					XftDrawStringUtf8(d, &drw->scheme[invert ? ColBg : ColFg],
-					                  usedfont->xfont, x, ty, (XftChar8 *)buf, len);
+					batch_add(drw, &drw->scheme[invert ? ColBg : ColFg], usedfont,
+					          x, ty, buf, len, x0, y, w0, h);
 				}
 				x += ew;
 				w -= ew;
 			}
 		}
 
-		if (!*text) {
+		if (!*text || trunc)
 			break;
-		} else if (nextfont) {
-			charexists = 0;
-			usedfont = nextfont;
-		} else {
-			/* Regardless of whether or not a fallback font is found, the
-			 * character must be drawn. */
-			charexists = 1;
-
-			fccharset = FcCharSetCreate();
-			FcCharSetAddChar(fccharset, utf8codepoint);
-
-			if (!drw->fonts->pattern) {
-				/* Refer to the comment in xfont_create for more information. */
-				die("the first font in the cache must be loaded from a font string.");
-			}
-
-			fcpattern = FcPatternDuplicate(drw->fonts->pattern);
-			FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
-			FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
-			FcPatternAddBool(fcpattern, FC_COLOR, FcFalse);
-
-			FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
-			FcDefaultSubstitute(fcpattern);
-			match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
-
-			FcCharSetDestroy(fccharset);
-			FcPatternDestroy(fcpattern);
-
-			if (match) {
-				usedfont = xfont_create(drw, NULL, match);
-				if (usedfont && XftCharExists(drw->dpy, usedfont->xfont, utf8codepoint)) {
-					for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
-						; /* NOP */
-					curfont->next = usedfont;
-				} else {
-					xfont_free(usedfont);
-					usedfont = drw->fonts;
-				}
-			}
-		}
+		usedfont = nextfont;
 	}
-	if (d)
-		XftDrawDestroy(d);
+	if (hash)
+		runcache_put(drw, hash, str, x0, y, w0, h, lpad, fg, bg);
 
 	return x + (render ? w : 0);
 }
@@ -374,16 +1076,53 @@ drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
 	if (!drw)
 		return;
 
-	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
-	XSync(drw->dpy, False);
+	drw_flush(drw);
+	XCopyArea(drw->dpy, drw->buf->drawable, win, drw->gc, x, y, w, h, x, y);
+	XFlush(drw->dpy);
 }
 
+/* Widths are remembered per string and fontset in a small LRU, so repeated
+ * measuring of tags, titles and status blocks does not touch Xft. */
 unsigned int
 drw_fontset_getwidth(Drw *drw, const char *text)
 {
+	struct ExtCache *ec;
+	struct ExtEntry *e, **pe;
+	unsigned long h;
+
 	if (!drw || !drw->fonts || !text)
 		return 0;
-	return drw_text(drw, 0, 0, 0, 0, 0, text, 0);
+
+	if (!(ec = drw->ext))
+		ec = drw->ext = ecalloc(1, sizeof(struct ExtCache));
+	h = exthash(text);
+	for (e = ec->bucket[h % EXT_BUCKETS]; e; e = e->hnext)
+		if (e->hash == h && e->fonts == drw->fonts && !strcmp(e->text, text)) {
+			extcache_unlink(ec, e);
+			extcache_push(ec, e);
+			return e->w;
+		}
+
+	if (ec->n < EXT_SIZ) {
+		e = ecalloc(1, sizeof(struct ExtEntry));
+		ec->n++;
+	} else {
+		/* evict the least recently used entry and reuse it */
+		e = ec->tail;
+		extcache_unlink(ec, e);
+		for (pe = &ec->bucket[e->hash % EXT_BUCKETS]; *pe != e; pe = &(*pe)->hnext)
+			; /* NOP */
+		*pe = e->hnext;
+		free(e->text);
+	}
+	e->w = drw_text(drw, 0, 0, 0, 0, 0, text, 0);
+	e->text = strdup(text);
+	e->hash = h;
+	e->fonts = drw->fonts;
+	e->hnext = ec->bucket[h % EXT_BUCKETS];
+	ec->bucket[h % EXT_BUCKETS] = e;
+	extcache_push(ec, e);
+	return e->w;
 }
 
 void
@@ -15,6 +15,12 @@ typedef struct Fnt {
 enum { ColFg, ColBg, ColBorder }; /* Clr scheme index */
 typedef XftColor Clr;
 
+typedef struct {
+	unsigned int w, h;
+	Drawable drawable;
+	XftDraw *xftdraw;
+} Buf;
+
 typedef struct {
 	unsigned int w, h;
 	Display *dpy;
@@ -23,10 +29,22 @@ typedef struct {
 	Visual *visual;
 	unsigned int depth;
 	Colormap cmap;
-	Drawable drawable;
+	Buf *buf;                 /* current target, own or set by drw_setbuf */
+	Buf *own;
 	GC gc;
+	unsigned long gcfg;       /* GC foreground, valid if gcfgset */
+	int gcfgset;
 	Clr *scheme;
 	Fnt *fonts;
+	int asciifont;            /* the primary font covers all printable ASCII */
+	unsigned char *bmpfont;   /* codepoint -> font index + 1 for the BMP */
+	struct CpFont *cpfont;    /* same for the other planes, open addressing */
+	size_t cpfontsize, cpfontused;
+	struct ExtCache *ext;     /* text width LRU, see drw_fontset_getwidth */
+	struct ClrEntry *clrs;    /* direct-mapped, see drw_clr_get */
+	struct RunCache *runs;    /* rendered text LRU, see drw_text */
+	struct GlyphBatch *batch; /* glyphs not yet sent, see drw_flush */
+	struct FontWorker *worker;/* fallback font lookups, see drw_fontset_poll */
 } Drw;
 
 /* Drawable abstraction */
@@ -34,15 +52,23 @@ Drw *drw_create(Display *dpy, int screen, Window win, unsigned int w, unsigned i
 void drw_resize(Drw *drw, unsigned int w, unsigned int h);
 void drw_free(Drw *drw);
 
+/* Back buffer abstraction */
+Buf *drw_buf_create(Drw *drw, unsigned int w, unsigned int h);
+void drw_buf_resize(Drw *drw, Buf *buf, unsigned int w, unsigned int h);
+void drw_buf_free(Drw *drw, Buf *buf);
+
 /* Fnt abstraction */
 Fnt *drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount);
 void drw_fontset_free(Fnt* set);
+int drw_fontset_fd(Drw *drw);
+int drw_fontset_poll(Drw *drw);
 unsigned int drw_fontset_getwidth(Drw *drw, const char *text);
 void drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w, unsigned int *h);
 
 /* Colorscheme abstraction */
 void drw_clr_create(Drw *drw, Clr *dest, const char *clrname, unsigned int alpha);
 Clr *drw_scm_create(Drw *drw, const char *clrnames[], const unsigned int alphas[], size_t clrcount);
+const Clr *drw_clr_get(Drw *drw, const char *clrname, unsigned int alpha);
 
 /* Cursor abstraction */
 Cur *drw_cur_create(Drw *drw, int shape);
@@ -51,10 +77,15 @@ void drw_cur_free(Drw *drw, Cur *cursor);
 /* Drawing context manipulation */
 void drw_setfontset(Drw *drw, Fnt *set);
 void drw_setscheme(Drw *drw, Clr *scm);
+void drw_setbuf(Drw *drw, Buf *buf);
+void drw_settextcache(Drw *drw, size_t max);
 
 /* Drawing functions */
 void drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert);
 int drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert);
 
+/* Sends glyphs drw_text has batched up, drw_map does so implicitly */
+void drw_flush(Drw *drw);
+
 /* Map functions */
 void drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h);
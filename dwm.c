@@ -22,6 +22,7 @@
  */
 #include <X11/X.h>
 #include <errno.h>
+#include <limits.h>
 #include <locale.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -32,10 +33,12 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/time.h>
+#include <sys/select.h>
 #include <X11/cursorfont.h>
 #include <X11/keysym.h>
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xproto.h>
 #include <X11/Xutil.h>
 #ifdef XINERAMA
@@ -53,12 +56,16 @@
 #define INTERSECT(x,y,w,h,m)    (MAX(0, MIN((x)+(w),(m)->wx+(m)->ww) - MAX((x),(m)->wx)) \
                                * MAX(0, MIN((y)+(h),(m)->wy+(m)->wh) - MAX((y),(m)->wy)))
 #define ISVISIBLE(C)            ((C->isglobal || C->tags & C->mon->tagset[C->mon->seltags]))
-#define HIDDEN(C)               ((getstate(C->win) == IconicState))
+#define HIDDEN(C)               ((C)->state == IconicState)
 #define LENGTH(X)               (sizeof X / sizeof X[0])
 #define MOUSEMASK               (BUTTONMASK|PointerMotionMask)
+#define ROOTMASK                (SubstructureRedirectMask|SubstructureNotifyMask|ButtonPressMask|PointerMotionMask \
+                                 |EnterWindowMask|LeaveWindowMask|StructureNotifyMask|PropertyChangeMask)
+#define CLIENTMASK              (EnterWindowMask|FocusChangeMask|PropertyChangeMask|StructureNotifyMask)
 #define WIDTH(X)                ((X)->w + 2 * (X)->bw)
 #define HEIGHT(X)               ((X)->h + 2 * (X)->bw)
 #define TAGMASK                 ((1 << LENGTH(tags)) - 1)
+#define STATUSLEN               1024
 #define TEXTW(X)                (drw_fontset_getwidth(drw, (X)) + lrpad)
 #define SYSTEM_TRAY_REQUEST_DOCK    0
 
@@ -100,6 +107,11 @@ enum { Manager, Xembed, XembedInfo, XLast }; /* Xembed atoms */
 enum { WMProtocols, WMDelete, WMState, WMTakeFocus, WMLast }; /* default atoms */
 enum { ClkTagBar, ClkLtSymbol, ClkStatusText, ClkWinTitle, ClkBarEmpty,
        ClkClientWin, ClkRootWin, ClkLast }; /* clicks */
+enum { WinClient, WinSystrayIcon, WinBar, WinPreview }; /* window registry */
+enum { DirtyArrange = 1 << 0, DirtyRestack = 1 << 1, DirtyBar = 1 << 2 }; /* deferred monitor work */
+enum { BarStatus, BarTags, BarLtSymbol, BarFiller, BarTasks }; /* bar regions, tasks last */
+enum { PropWMState, PropNetWMName, PropWMName, PropTransient, PropNetWMState,
+       PropWindowType, PropNormalHints, PropWMHints, PropClass, PropLast }; /* properties read by manage() */
 enum { UP, DOWN, LEFT, RIGHT }; /* movewin */
 enum { V_EXPAND, V_REDUCE, H_EXPAND, H_REDUCE }; /* resizewins */
 
@@ -138,8 +150,12 @@ struct Client {
     int taskw;
 	unsigned int tags;
 	int isfixed, isfloating, isurgent, neverfocus, oldstate, isfullscreen, isglobal, isnoborder, isscratchpad;
-	Client *next;
-	Client *snext;
+	long state; /* WM_STATE as last set by dwm or reported by PropertyNotify */
+	int iconx, iconw, iconh; /* systray icon layout last applied, iconh 0 until laid out */
+	int sentx, senty;        /* window position last sent to the server */
+	Client *next, *prev;   /* clients list, prev is NULL at the head */
+	Client *snext, *sprev; /* focus stack */
+	Client *vnext;         /* visible chain, only valid while on it, see visible() */
 	Monitor *mon;
 	Window win;
     Preview preview;
@@ -157,6 +173,11 @@ typedef struct {
 	void (*arrange)(Monitor *);
 } Layout;
 
+typedef struct {
+	int x, w;          /* w < 0 marks the region as not in the buffer */
+	unsigned long key; /* hash of everything drawn into it */
+} BarRegion;
+
 typedef struct Pertag Pertag;
 struct Monitor {
 	char ltsymbol[16];
@@ -172,11 +193,24 @@ struct Monitor {
 	unsigned int tagset[2];
 	int showbar;
 	int topbar;
+	unsigned int dirty;   /* Dirty* work pending until the next flushdirty() */
 	Client *clients;
+	Client *ctail;        /* last of clients, for appending in attach() */
+	Client *vis;          /* visible clients in clients order, see visible() */
+	unsigned int vistags; /* tagset vis was built for */
+	int visok;            /* vis matches clients and their tags */
 	Client *sel;
 	Client *stack;
 	Monitor *next;
 	Window barwin;
+	Buf *barbuf;
+	BarRegion *regions;   /* what barbuf currently holds, see renderbar() */
+	unsigned int nregions;
+	int barx, bary, barw; /* barwin geometry last applied */
+	int barleft;          /* right end of tags, layout symbol and tasks, see renderbar() */
+	Window *stackwins;    /* barwin and tiled clients as last sent by restackmon() */
+	unsigned int nstack, stackcap;
+	Window raised;        /* floating client restackmon() last raised */
 	const Layout *lt[2];
 	Pertag *pertag;
 };
@@ -197,8 +231,54 @@ typedef struct Systray   Systray;
 struct Systray {
 	Window win;
 	Client *icons;
+	int iconsw;           /* getsystraywidth() result, -1 when stale */
+	int x, y, w;          /* win geometry last applied */
+	Window sibling;       /* bar win was last stacked above */
 };
 
+typedef struct {
+	unsigned long first, last; /* request serials, inclusive */
+	const char *op;            /* issuing operation, for diagnostics */
+	int ignore;                /* swallow any error, like xerrordummy */
+} ReqSpan;
+
+typedef struct {
+	const char *text;   /* span of StatusFrame.text, codes cut out */
+	const char *signal; /* ^s name in effect, "" if none */
+	int w;              /* measured width without lrpad */
+	Clr fg, bg;
+} StatusBlock;
+
+typedef struct {
+	int x0, x1;         /* [x0, x1) relative to the first status block */
+	const char *signal;
+} StatusHit;
+
+typedef struct {
+	char text[STATUSLEN];                  /* stext as split by parsestatus() */
+	StatusBlock blocks[STATUSLEN / 3 + 1];
+	StatusHit hits[STATUSLEN / 3 + 1];     /* click ranges, see maphits() */
+	int n, w;                              /* block count, total width */
+	int nhits;                             /* -1 until mapped */
+} StatusFrame;
+
+typedef struct {
+	int type;
+	Window win, sub;      /* event window and what it is about, see coalescekey() */
+	unsigned long serial;
+	long mask;            /* ConfigureRequest value_mask */
+	int key;              /* see coalescekey() */
+	int ktype;            /* what scanqueue() matches on, with sub */
+	Window kwin;
+	int skip;             /* a later queued event makes this one redundant */
+} Queued;
+
+typedef struct {
+	Window win;  /* None marks a free slot */
+	int kind;    /* WinClient, WinSystrayIcon, ... */
+	void *p;     /* Client * or Monitor * depending on kind */
+} WinEntry;
+
 /* function declarations */
 static void logtofile(const char *fmt, ...);
 
@@ -206,11 +286,16 @@ static void tile(Monitor *m);
 static void magicgrid(Monitor *m);
 static void grid(Monitor *m, uint gappo, uint uappi);
 
-static void applyrules(Client *c);
+static void applyrules(Client *c, const char *class, const char *instance);
 static int applysizehints(Client *c, int *x, int *y, int *w, int *h, int interact);
 static void arrange(Monitor *m);
 static void arrangemon(Monitor *m);
 static void attach(Client *c);
+static void attachhead(Client *c);
+static void indexclient(Client *c, int d);
+static void retag(Client *c, unsigned int tags, int isglobal, int isurgent);
+static unsigned int occupied(Monitor *m);
+static unsigned int urgenttags(Monitor *m);
 static void attachstack(Client *c);
 static void buttonpress(XEvent *e);
 static void checkotherwm(void);
@@ -229,7 +314,15 @@ static Monitor *dirtomon(int dir);
 
 static void drawbar(Monitor *m);
 static void drawbars(void);
-static int drawstatusbar(Monitor *m, int bh, char* text);
+static void renderbar(Monitor *m);
+static int barregion(Monitor *m, unsigned int i, int x, int w, unsigned long key, int force, int *damage);
+static void invalidatebar(Monitor *m);
+static unsigned long keymix(unsigned long h, unsigned long v);
+static unsigned long keystr(unsigned long h, const char *s);
+static int drawstatusbar(Monitor *m, int bh);
+static void drawstatusblocks(Monitor *m, const StatusFrame *old);
+static int statusx(Monitor *m);
+static void maphits(StatusFrame *st);
 
 static void enternotify(XEvent *e);
 static void expose(XEvent *e);
@@ -244,6 +337,10 @@ static void pointerclient(Client *c);
 static Atom getatomprop(Client *c, Atom prop);
 static int getrootptr(int *x, int *y);
 static long getstate(Window w);
+static void getprops(Window w, xcb_get_property_reply_t **r);
+static uint32_t *prop32(xcb_get_property_reply_t *r, int *n);
+static int proptext(xcb_get_property_reply_t *r, char *text, unsigned int size);
+static int textprop(XTextProperty *name, char *text, unsigned int size);
 static unsigned int getsystraywidth();
 static int gettextprop(Window w, Atom atom, char *text, unsigned int size);
 
@@ -251,8 +348,12 @@ static void grabbuttons(Client *c, int focused);
 static void grabkeys(void);
 
 static void hide(Client *c);
+static void hideclient(Client *c);
 static void show(Client *c);
+static void showclient(Client *c);
+static void pophidden(Client *c);
 static void showtag(Client *c);
+static void sendmove(Client *c, int x, int y);
 static void hidewin(const Arg *arg);
 static void hideotherwins(const Arg *arg);
 static void showonlyorall(const Arg *arg);
@@ -272,6 +373,8 @@ static void movemouse(const Arg *arg);
 static void movewin(const Arg *arg);
 static void resizewin(const Arg *arg);
 static Client *nexttiled(Client *c);
+static Client *visible(Monitor *m);
+static int cyclable(Client *c, int issingle);
 static void pop(Client *);
 static void propertynotify(XEvent *e);
 static void quit(const Arg *arg);
@@ -289,8 +392,16 @@ static void resizeclient(Client *c, int x, int y, int w, int h);
 static void resizemouse(const Arg *arg);
 static void resizerequest(XEvent *e);
 static void restack(Monitor *m);
+static void restackmon(Monitor *m);
+static void invalidatestack(Monitor *m);
+static void markdirty(Monitor *m, unsigned int flags);
+static void flushdirty(void);
 
 static void run(void);
+static int coalescekey(XEvent *ev, Window *sub);
+static Bool recordevent(Display *dpy, XEvent *ev, XPointer arg);
+static void scanqueue(void);
+static int superseded(XEvent *ev);
 static void runAutostart(void);
 static void scan(void);
 static int sendevent(Window w, Atom proto, int m, long d0, long d1, long d2, long d3, long d4);
@@ -330,13 +441,18 @@ static void updateclientlist(void);
 static int updategeom(void);
 static void updatenumlockmask(void);
 static void updatesizehints(Client *c);
+static void setsizehints(Client *c, XSizeHints *size);
 static void updatestatus(void);
+static const StatusFrame *parsestatus(void);
+static int blockcmp(const StatusBlock *a, const StatusBlock *b);
 static void updatesystray(void);
 static void updatesystrayicongeom(Client *i, int w, int h);
 static void updatesystrayiconstate(Client *i, XPropertyEvent *ev);
 static void updatetitle(Client *c);
 static void updatewindowtype(Client *c);
+static void setwindowtype(Client *c, Atom state, Atom wtype);
 static void updatewmhints(Client *c);
+static void setwmhints(Client *c, XWMHints *wmh);
 
 static void setgap(const Arg *arg);
 
@@ -347,9 +463,14 @@ static void viewtoright(const Arg *arg);
 static void exchange_client(const Arg *arg);
 static void focusdir(const Arg *arg);
 
+static void regwin(Window w, int kind, void *p);
+static void unregwin(Window w);
+static void *lookupwin(Window w, int kind);
 static Client *wintoclient(Window w);
 static Monitor *wintomon(Window w);
 static Client *wintosystrayicon(Window w);
+static void trackreqs(unsigned long first, const char *op, int ignore);
+static const ReqSpan *reqspan(unsigned long serial);
 static int xerror(Display *dpy, XErrorEvent *ee);
 static int xerrordummy(Display *dpy, XErrorEvent *ee);
 static int xerrorstart(Display *dpy, XErrorEvent *ee);
@@ -364,10 +485,13 @@ static XImage *scaledownimage(Client *c, unsigned int cw, unsigned int ch);
 /* variables */
 static Systray *systray =  NULL;
 static const char broken[] = "broken";
-static char stext[1024];
+static char stext[STATUSLEN];
+static StatusFrame statusbuf[2], *status = &statusbuf[0]; /* current and previous frame */
+static unsigned long statusserial = 0; /* bumped by every parsestatus() */
 static int screen;
 static int sw, sh;           /* X display screen geometry width, height */
 static int bh, blw = 0;      /* bar geometry */
+static int moncount, monmaxx, monmaxb; /* monitor count, largest x and bottom, see updategeom() */
 static int lrpad;            /* sum of left and right padding for text */
 static int vp;               /* vertical padding for bar */
 static int sp;               /* side padding for bar */
@@ -395,6 +519,7 @@ static int running = 1;
 static Cur *cursor[CurLast];
 static Clr **scheme;
 static Display *dpy;
+static xcb_connection_t *xcon; /* dpy's xcb connection, for pipelined requests */
 static Drw *drw;
 static int useargb = 0;
 static Visual *visual;
@@ -403,6 +528,14 @@ static Colormap cmap;
 static Monitor *mons, *selmon;
 static Window root, wmcheckwin;
 
+static WinEntry *wintab = NULL; /* open addressing, Window -> Client/Monitor */
+static size_t wintabsize = 0, wintabused = 0;
+static ReqSpan reqspans[256]; /* ring of recent unsynced requests, see xerror() */
+static unsigned int reqspanpos = 0;
+static unsigned long enterserial = 0; /* EnterNotify up to here came from restacking */
+static Queued *queued;       /* the batch run() dispatches, see scanqueue() */
+static unsigned int nqueued, queuedcap, queuedpos;
+
 static int hiddenWinStackTop = -1;
 static Client *hiddenWinStack[100];
 
@@ -416,6 +549,9 @@ struct Pertag {
 	unsigned int sellts[LENGTH(tags) + 1]; /* selected layouts */
 	const Layout *ltidxs[LENGTH(tags) + 1][2]; /* matrix of tags and layouts indexes  */
 	int showbars[LENGTH(tags) + 1]; /* display bar for the current tag */
+	unsigned int ntagged[LENGTH(tags)]; /* clients per tag, those on every tag excluded */
+	unsigned int nurgent[LENGTH(tags)]; /* urgent clients per tag */
+	unsigned int nalltags;              /* non global clients on every tag */
 };
 
 /* function implementations */
@@ -435,13 +571,11 @@ logtofile(const char *fmt, ...)
 }
 
 void
-applyrules(Client *c)
+applyrules(Client *c, const char *class, const char *instance)
 {
-    const char *class, *instance;
     unsigned int i;
     const Rule *r;
     Monitor *m;
-    XClassHint ch = { NULL, NULL };
 
     /* rule matching */
     c->isfloating = 0;
@@ -449,9 +583,6 @@ applyrules(Client *c)
     c->isnoborder = 0;
     c->isscratchpad = 0;
     c->tags = 0;
-    XGetClassHint(dpy, c->win, &ch);
-    class    = ch.res_class ? ch.res_class : broken;
-    instance = ch.res_name  ? ch.res_name  : broken;
 
     for (i = 0; i < LENGTH(rules); i++) {
         r = &rules[i];
@@ -491,10 +622,6 @@ applyrules(Client *c)
         c->isfloating = 1;
         c->isglobal = 1; // scratchpad is default global
     } 
-    if (ch.res_class)
-        XFree(ch.res_class);
-    if (ch.res_name)
-        XFree(ch.res_name);
     c->tags = c->tags & TAGMASK ? c->tags & TAGMASK : c->mon->tagset[c->mon->seltags];
 }
 
@@ -567,15 +694,8 @@ applysizehints(Client *c, int *x, int *y, int *w, int *h, int interact)
 void
 arrange(Monitor *m)
 {
-    if (m)
-        showtag(m->stack);
-    else for (m = mons; m; m = m->next)
-        showtag(m->stack);
-    if (m) {
-        arrangemon(m);
-        restack(m);
-    } else for (m = mons; m; m = m->next)
-        arrangemon(m);
+    /* arrangemon() may change ltsymbol and the tasks, so the bar follows */
+    markdirty(m, m ? DirtyArrange|DirtyRestack|DirtyBar : DirtyArrange|DirtyBar);
 }
 
 void
@@ -589,20 +709,99 @@ void
 attach(Client *c)
 {
     if (!newclientathead) {
-        Client **tc;
-        for (tc = &c->mon->clients; *tc; tc = &(*tc)->next);
-        *tc = c;
         c->next = NULL;
-    } else {
-        c->next = c->mon->clients;
-        c->mon->clients = c;
+        c->prev = c->mon->ctail;
+        if (c->prev)
+            c->prev->next = c;
+        else
+            c->mon->clients = c;
+        c->mon->ctail = c;
+        c->mon->visok = 0;
+        indexclient(c, 1);
+    } else
+        attachhead(c);
+}
+
+void
+attachhead(Client *c)
+{
+    c->prev = NULL;
+    c->next = c->mon->clients;
+    if (c->next)
+        c->next->prev = c;
+    else
+        c->mon->ctail = c;
+    c->mon->clients = c;
+    c->mon->visok = 0;
+    indexclient(c, 1);
+}
+
+// 按tag统计clients，attach/detach及retag时维护，d为1计入，-1撤销
+void
+indexclient(Client *c, int d)
+{
+    Pertag *p = c->mon->pertag;
+    unsigned int i;
+
+    if (c->tags == TAGMASK && !c->isglobal)
+        p->nalltags += d;
+    for (i = 0; i < LENGTH(tags); i++)
+        if (c->tags & 1 << i) {
+            if (c->tags != TAGMASK)
+                p->ntagged[i] += d;
+            if (c->isurgent)
+                p->nurgent[i] += d;
+        }
+}
+
+// 修改client的tags/isglobal/isurgent，已attach的client同步更新统计
+void
+retag(Client *c, unsigned int tags, int isglobal, int isurgent)
+{
+    int attached = c->prev || c->mon->clients == c;
+
+    if (attached) {
+        indexclient(c, -1);
+        c->mon->visok = 0;
     }
+    c->tags = tags;
+    c->isglobal = isglobal;
+    c->isurgent = isurgent;
+    if (attached)
+        indexclient(c, 1);
+}
+
+// 有client的tag，不含位于全部tag上的client
+unsigned int
+occupied(Monitor *m)
+{
+    unsigned int i, occ = 0;
+
+    for (i = 0; i < LENGTH(tags); i++)
+        if (m->pertag->ntagged[i])
+            occ |= 1 << i;
+    return occ;
+}
+
+// 有urgent client的tag
+unsigned int
+urgenttags(Monitor *m)
+{
+    unsigned int i, urg = 0;
+
+    for (i = 0; i < LENGTH(tags); i++)
+        if (m->pertag->nurgent[i])
+            urg |= 1 << i;
+    return urg;
 }
 
 void
 attachstack(Client *c)
 {
+    c->sprev = NULL;
     c->snext = c->mon->stack;
+    if (c->snext)
+        c->snext->sprev = c;
     c->mon->stack = c;
 }
 
@@ -623,14 +822,12 @@ buttonpress(XEvent *e)
         selmon = m;
         focus(NULL);
     }
-    int status_w = drawstatusbar(selmon, bh, stext);
+    int status_w = status->w - 2;
     int system_w = getsystraywidth();
     if (ev->window == selmon->barwin || (!c && selmon->showbar && (topbar ? ev->y <= selmon->wy : ev->y >= selmon->wy + selmon->wh))) { // 点击在bar上
         i = x = 0;
         blw = TEXTW(selmon->ltsymbol);
-        
-        for (c = m->clients; c; c = c->next)
-            occ |= c->tags == TAGMASK ? 0 : c->tags;
+        occ = occupied(m);
         do {
             /* do not reserve space for vacant tags */
             if (!(occ & 1 << i || m->tagset[m->seltags] & 1 << i))
@@ -650,15 +847,7 @@ buttonpress(XEvent *e)
             click = ClkBarEmpty;
 
             x += blw;
-            c = m->clients;
-
-            if (m->bt != 0)
-                do {
-                    if (!ISVISIBLE(c))
-                        continue;
-                    else
-                        x += c->taskw;
-                } while (ev->x > x && (c = c->next));
+            for (c = m->bt ? visible(m) : NULL; c && (x += c->taskw) < ev->x; c = c->vnext);
 
             if (c) {
                 click = ClkWinTitle;
@@ -698,6 +887,7 @@ cleanup(void)
     size_t i;
 
     view(&a);
+    flushdirty();
     selmon->lt[selmon->sellt] = &foo;
     for (m = mons; m; m = m->next)
         while (m->stack)
@@ -715,6 +905,7 @@ cleanup(void)
     for (i = 0; i < LENGTH(colors) + 1; i++)
         free(scheme[i]);
     XDestroyWindow(dpy, wmcheckwin);
+    free(wintab);
     drw_free(drw);
     XSync(dpy, False);
     XSetInputFocus(dpy, PointerRoot, RevertToPointerRoot, CurrentTime);
@@ -732,8 +923,12 @@ cleanupmon(Monitor *mon)
         for (m = mons; m && m->next != mon; m = m->next);
         m->next = mon->next;
     }
+    unregwin(mon->barwin);
     XUnmapWindow(dpy, mon->barwin);
     XDestroyWindow(dpy, mon->barwin);
+    drw_buf_free(drw, mon->barbuf);
+    free(mon->regions);
+    free(mon->stackwins);
     free(mon);
 }
 
@@ -757,6 +952,7 @@ clientmessage(XEvent *e)
             c->mon = selmon;
             c->next = systray->icons;
             systray->icons = c;
+            regwin(c->win, WinSystrayIcon, c);
             XGetWindowAttributes(dpy, c->win, &wa);
             c->x = c->oldx = c->y = c->oldy = 0;
             c->w = c->oldw = wa.width;
@@ -843,7 +1039,6 @@ configurenotify(XEvent *e)
         sw = ev->width;
         sh = ev->height;
         if (updategeom() || dirty) {
-            drw_resize(drw, sw, bh);
             updatebars();
             for (m = mons; m; m = m->next) {
                 for (c = m->clients; c; c = c->next)
@@ -892,8 +1087,11 @@ configurerequest(XEvent *e)
                 c->y = m->my + (m->mh / 2 - HEIGHT(c) / 2); /* center in y direction */
             if ((ev->value_mask & (CWX|CWY)) && !(ev->value_mask & (CWWidth|CWHeight)))
                 configure(c);
-            if (ISVISIBLE(c))
+            if (ISVISIBLE(c)) {
                 XMoveResizeWindow(dpy, c->win, c->x, c->y, c->w, c->h);
+                c->sentx = c->x;
+                c->senty = c->y;
+            }
         } else
             configure(c);
     } else {
@@ -905,6 +1103,8 @@ configurerequest(XEvent *e)
         wc.sibling = ev->above;
         wc.stack_mode = ev->detail;
         XConfigureWindow(dpy, ev->window, ev->value_mask, &wc);
+        if (ev->value_mask & CWStackMode)
+            invalidatestack(NULL);
     }
     XSync(dpy, False);
 }
@@ -959,19 +1159,31 @@ destroynotify(XEvent *e)
 void
 detach(Client *c)
 {
-    Client **tc;
-
-    for (tc = &c->mon->clients; *tc && *tc != c; tc = &(*tc)->next);
-    *tc = c->next;
+    indexclient(c, -1);
+    c->mon->visok = 0;
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        c->mon->clients = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    else
+        c->mon->ctail = c->prev;
+    c->next = c->prev = NULL;
 }
 
 void
 detachstack(Client *c)
 {
-    Client **tc, *t;
+    Client *t;
 
-    for (tc = &c->mon->stack; *tc && *tc != c; tc = &(*tc)->snext);
-    *tc = c->snext;
+    if (c->sprev)
+        c->sprev->snext = c->snext;
+    else
+        c->mon->stack = c->snext;
+    if (c->snext)
+        c->snext->sprev = c->sprev;
+    c->snext = c->sprev = NULL;
 
     if (c == c->mon->sel) {
         for (t = c->mon->stack; t && !ISVISIBLE(t); t = t->snext);
@@ -997,221 +1209,266 @@ dirtomon(int dir)
 void
 drawbar(Monitor *m)
 {
-    int x, empty_w;
+    markdirty(m, DirtyBar);
+}
+
+void
+drawbars(void)
+{
+    markdirty(NULL, DirtyBar);
+}
+
+// 标记bar缓冲内容全部失效，下次绘制时全部重绘
+void
+invalidatebar(Monitor *m)
+{
+    unsigned int i;
+
+    for (i = 0; i < m->nregions; i++)
+        m->regions[i].w = -1;
+}
+
+// 比较区域i的位置与内容key，有变化(或force)时更新缓存并扩展damage，返回是否需要重绘
+int
+barregion(Monitor *m, unsigned int i, int x, int w, unsigned long key, int force, int *damage)
+{
+    BarRegion *r;
+    unsigned int n;
+
+    if (i >= m->nregions) {
+        n = i + 8;
+        if (!(m->regions = realloc(m->regions, n * sizeof(BarRegion))))
+            die("realloc:");
+        for (; m->nregions < n; m->nregions++)
+            m->regions[m->nregions].w = -1;
+    }
+    r = &m->regions[i];
+    if (!force && r->x == x && r->w == w && r->key == key)
+        return 0;
+    r->x = x;
+    r->w = w;
+    r->key = key;
+    damage[0] = MIN(damage[0], x);
+    damage[1] = MAX(damage[1], x + w);
+    return 1;
+}
+
+unsigned long
+keymix(unsigned long h, unsigned long v)
+{
+    return (h ^ v) * 1099511628211UL;
+}
+
+unsigned long
+keystr(unsigned long h, const char *s)
+{
+    while (*s)
+        h = keymix(h, (unsigned char)*s++);
+    return h;
+}
+
+// 按区域绘制bar: 仅重绘位置或内容变化的区域，并只将变化范围复制到barwin
+void
+renderbar(Monitor *m)
+{
+    int x, sx, empty_w;
     int w = 0;
-    int system_w = 0, tasks_w = 0, status_w;
-    unsigned int i, occ = 0, n = 0, urg = 0, scm;
+    int system_w = 0, tasks_w = 0, status_w, sdamaged;
+    int damage[2] = { INT_MAX, 0 };
+    unsigned int i, occ, n = 0, urg, scm, shown = 0, r;
+    unsigned long first = NextRequest(dpy), key;
+    const char *name;
     Client *c;
 	int boxw = 2;
 
     if (!m->showbar)
         return;
+    if (m->barbuf->w != m->ww || m->barbuf->h != bh) {
+        drw_buf_resize(drw, m->barbuf, m->ww, bh);
+        invalidatebar(m);
+    }
+    drw_setbuf(drw, m->barbuf);
 
     // 获取系统托盘的宽度
     if(showsystray && m == systraytomon(m))
         system_w = getsystraywidth();
 
-    // 绘制STATUSBAR
-    status_w = drawstatusbar(m, bh, stext);
+    // 绘制STATUSBAR, 文本比底色多占1px
+    sx = statusx(m);
+    status_w = status->w - 2;
+    if ((sdamaged = barregion(m, BarStatus, sx, status->w + 1, statusserial, 0, damage)))
+        drawstatusbar(m, bh);
 
     // 判断tag显示数量
-    for (c = m->clients; c; c = c->next) {
-        if (ISVISIBLE(c))
-            n++;
-        occ |= c->tags == TAGMASK ? 0 : c->tags;
-        if (c->isurgent)
-            urg |= c->tags;
-    }
+    for (c = visible(m); c; c = c->vnext)
+        n++;
+    occ = occupied(m);
+    urg = urgenttags(m);
 
     // 绘制TAGS
-    x = 0;
-
-    for (i = 0; i < LENGTH(tags); i++) {
-        /* do not draw vacant tags */
-        if (!(occ & 1 << i || m->tagset[m->seltags] & 1 << i))
-            continue;
+    for (x = i = 0; i < LENGTH(tags); i++)
+        if (occ & 1 << i || m->tagset[m->seltags] & 1 << i) {
+            shown |= 1 << i;
+            x += TEXTW(tags[i]);
+        }
+    key = keymix(keymix(keymix(0, shown), m->tagset[m->seltags] & shown), urg & shown);
+    if (barregion(m, BarTags, 0, x, key, sdamaged && x > sx, damage)) {
+        x = 0;
+        for (i = 0; i < LENGTH(tags); i++) {
+            /* do not draw vacant tags */
+            if (!(shown & 1 << i))
+                continue;
 
-        w = TEXTW(tags[i]);
-        drw_setscheme(drw, scheme[m->tagset[m->seltags] & 1 << i ? SchemeSelTag : SchemeNormTag]);
-        drw_text(drw, x, 0, w, bh, lrpad / 2, tags[i], urg & 1 << i);
-        if (m->tagset[m->seltags] & 1 << i) {
-            drw_setscheme(drw, scheme[SchemeUnderline]);
-            drw_rect(drw, x + 2, bh - boxw, w + lrpad - 4, boxw, 1, 0);
+            w = TEXTW(tags[i]);
+            drw_setscheme(drw, scheme[m->tagset[m->seltags] & 1 << i ? SchemeSelTag : SchemeNormTag]);
+            drw_text(drw, x, 0, w, bh, lrpad / 2, tags[i], urg & 1 << i);
+            if (m->tagset[m->seltags] & 1 << i) {
+                drw_setscheme(drw, scheme[SchemeUnderline]);
+                drw_rect(drw, x + 2, bh - boxw, w + lrpad - 4, boxw, 1, 0);
+            }
+            x += w;
         }
-        x += w;
     }
 
     // 绘制模式图标
     w = TEXTW(m->ltsymbol);
-    drw_setscheme(drw, scheme[SchemeNorm]);
-    x = drw_text(drw, x, 0, w, bh, lrpad / 2, m->ltsymbol, 0);
+    if (barregion(m, BarLtSymbol, x, w, keystr(0, m->ltsymbol), sdamaged && x + w > sx, damage)) {
+        drw_setscheme(drw, scheme[SchemeNorm]);
+        drw_text(drw, x, 0, w, bh, lrpad / 2, m->ltsymbol, 0);
+    }
+    x += w;
 
     // 绘制TASKS
-    for (c = m->clients; c; c = c->next) {
-        // 判断是否需要绘制 && 判断颜色设置
-        if (!ISVISIBLE(c))
-            continue;
+    for (r = BarTasks, c = visible(m); c; c = c->vnext) {
+        // 判断颜色设置
         if (m->sel == c)
             scm = SchemeSel;
         else if (HIDDEN(c))
             scm = SchemeHid;
         else
             scm = SchemeNorm;
-        drw_setscheme(drw, scheme[scm]);
 
         // 绘制TASK
         w = MIN(TEXTW(c->name), TEXTW("          "));
-        empty_w = m->ww - x - status_w - system_w;
+        empty_w = MAX(sx - x, 0); // TASK不进入状态栏区域
+        name = c->name;
         if (w > empty_w) { // 如果当前TASK绘制后长度超过最大宽度
             w = empty_w;
-            x = drw_text(drw, x, 0, w, bh, lrpad / 2, "...", 0);
-            c->taskw = w;
-            tasks_w += w;
-            break;
-        } else {
-            x = drw_text(drw, x, 0, w, bh, lrpad / 2, c->name, 0);
-            c->taskw = w;
-            tasks_w += w;
+            name = "...";
+        }
+        if (barregion(m, r++, x, w, keystr(keymix((unsigned long)c, scm), name), 0, damage)) {
+            drw_setscheme(drw, scheme[scm]);
+            drw_text(drw, x, 0, w, bh, lrpad / 2, name, 0);
         }
+        x += w;
+        c->taskw = w;
+        tasks_w += w;
+        if (name != c->name)
+            break;
     }
+    // 之前多出的TASK区域已被覆盖
+    for (; r < m->nregions; r++)
+        m->regions[r].w = -1;
+    m->barleft = x;
+
     /** 空白部分的宽度 = 总宽度 - 状态栏的宽度 - 托盘的宽度 - sp (托盘存在时 额外多-一个 systrayspadding) */
     empty_w = m->ww - x - status_w - system_w - 2 * sp - (system_w ? systrayspadding : 0);
-    if (empty_w > 0) {
+    empty_w = MIN(empty_w, sx - x); /* stop where the status region starts, it owns those pixels */
+    if (barregion(m, BarFiller, x, MAX(empty_w, 0), 0, 0, damage) && empty_w > 0) {
         drw_setscheme(drw, scheme[SchemeBarEmpty]);
         drw_rect(drw, x, 0, empty_w, bh, 1, 1);
     }
 
     m->bt = n;
-    drw_map(drw, m->barwin, 0, 0, m->ww - system_w, bh);
+    damage[1] = MIN(damage[1], m->ww - system_w);
+    if (damage[0] < damage[1])
+        drw_map(drw, m->barwin, damage[0], 0, damage[1] - damage[0], bh);
 
     resizebarwin(m);
+    trackreqs(first, "drawbar", 0);
 }
 
-void
-drawbars(void)
-{
-    Monitor *m;
-
-    for (m = mons; m; m = m->next)
-        drawbar(m);
-}
-
+// 状态栏在bar中的起始x
 int
-drawstatusbar(Monitor *m, int bh, char* stext) {
-    int status_w = 0, i, w, x, len, system_w = 0;
-    short isCode = 0;
-    char *text;
-    char *p;
-    char buf8[8], buf5[5];
-    uint textsalpha;
+statusx(Monitor *m)
+{
+    int system_w = 0;
 
     if(showsystray && m == systraytomon(m))
         system_w = getsystraywidth();
 
-    len = strlen(stext) + 1 ;
-    if (!(text = (char*) malloc(sizeof(char)*len)))
-        die("malloc");
-    p = text;
-    memcpy(text, stext, len);
-
-    /* compute width of the status text */
-    w = 0;
-    i = -1;
-    while (text[++i]) {
-        if (text[i] == '^') {
-            if (!isCode) {
-                isCode = 1;
-                text[i] = '\0';
-                w += TEXTW(text) - lrpad;
-                text[i] = '^';
-            } else {
-                isCode = 0;
-                text = text + i + 1;
-                i = -1;
-            }
-        }
-    }
-    if (!isCode)
-        w += TEXTW(text) - lrpad;
-    else
-        isCode = 0;
-    text = p;
-
     // w += 2; /* 1px padding on both sides */
-    x = m->ww - w - system_w - 2 * sp - (system_w ? systrayspadding : 0); // 托盘存在时 额外多-一个systrayspadding
+    return m->ww - status->w - system_w - 2 * sp - (system_w ? systrayspadding : 0); // 托盘存在时 额外多-一个systrayspadding
+}
+
+int
+drawstatusbar(Monitor *m, int bh) {
+    int i, x = statusx(m);
+    StatusBlock *b;
 
     drw_setscheme(drw, scheme[LENGTH(colors)]);
     drw->scheme[ColFg] = scheme[SchemeNorm][ColFg];
     drw->scheme[ColBg] = scheme[SchemeNorm][ColBg];
-    drw_rect(drw, x, 0, w, bh, 1, 1);
+    drw_rect(drw, x, 0, status->w, bh, 1, 1);
     x++;
+    if (status->nhits < 0)
+        maphits(status);
+
+    for (i = 0; i < status->n; i++) {
+        b = &status->blocks[i];
+        drw->scheme[ColFg] = b->fg;
+        drw->scheme[ColBg] = b->bg;
+        drw_text(drw, x, 0, b->w, bh, 0, b->text, 0);
+        x += b->w;
+    }
 
-    /* process status text */
-    i = -1;
-    while (text[++i]) {
-        if (text[i] == '^' && !isCode) {
-            isCode = 1;
-
-            text[i] = '\0';
-            w = TEXTW(text) - lrpad;
-            drw_text(drw, x, 0, w, bh, 0, text, 0);
-            status_w += w;
-
-            x += w;
-
-            /* process code */
-            while (text[++i] != '^') {
-                if (text[i] == 'c') {
-                    memcpy(buf8, (char*)text+i+1, 7);
-                    buf8[7] = '\0';
-                    i += 7;
-
-                    textsalpha = alphas[SchemeStatusText][ColFg];
-                    if (text[i + 1] != '^') {
-                        memcpy(buf5, (char*)text+i+1, 4);
-                        buf5[4] = '\0';
-                        i += 4;
-                        sscanf(buf5, "%x", &textsalpha);
-                    }
+    drw_setscheme(drw, scheme[SchemeNorm]);
 
-                    drw_clr_create(drw, &drw->scheme[ColFg], buf8, textsalpha);
-                } else if (text[i] == 'b') {
-                    memcpy(buf8, (char*)text+i+1, 7);
-                    buf8[7] = '\0';
-                    i += 7;
-
-                    textsalpha = alphas[SchemeStatusText][ColBg];
-                    if (text[i + 1] != '^') {
-                        memcpy(buf5, (char*)text+i+1, 4);
-                        buf5[4] = '\0';
-                        i += 4;
-                        sscanf(buf5, "%x", &textsalpha);
-                    }
-                    drw_clr_create(drw, &drw->scheme[ColBg], buf8, textsalpha);
-                } else if (text[i] == 's') {
-                    while (text[i + 1] != '^') i++;
-                } else if (text[i] == 'd') {
-                    drw->scheme[ColFg] = scheme[SchemeNorm][ColFg];
-                    drw->scheme[ColBg] = scheme[SchemeNorm][ColBg];
-                }
-            }
+    return status->w - 2;
+}
 
-            text = text + i + 1;
-            i=-1;
-            isCode = 0;
-        }
-    }
+// 仅重绘与上一帧相比内容变化(宽度不变)的文本块
+void
+drawstatusblocks(Monitor *m, const StatusFrame *old)
+{
+    int i, x = statusx(m) + 1;
+    const StatusBlock *b;
 
-    if (!isCode) {
-        w = TEXTW(text) - lrpad;
-        drw_text(drw, x, 0, w, bh, 0, text, 0);
-        status_w += w;
+    drw_setbuf(drw, m->barbuf);
+    drw_setscheme(drw, scheme[LENGTH(colors)]);
+    for (i = 0; i < status->n; x += b->w, i++) {
+        b = &status->blocks[i];
+        if (!blockcmp(b, &old->blocks[i]))
+            continue;
+        drw->scheme[ColFg] = b->fg;
+        drw->scheme[ColBg] = b->bg;
+        drw_text(drw, x, 0, b->w, bh, 0, b->text, 0);
+        drw_map(drw, m->barwin, x, 0, b->w, bh);
     }
-
     drw_setscheme(drw, scheme[SchemeNorm]);
-    free(p);
+    if (m->nregions > BarStatus)
+        m->regions[BarStatus].key = statusserial;
+}
 
-    return status_w - 2;
+// 记录每个^s模块在状态栏中占据的x范围，点击时二分查找
+void
+maphits(StatusFrame *st)
+{
+    int i, x = 0;
+    StatusBlock *b;
+    StatusHit *h = NULL;
+
+    for (st->nhits = i = 0; i < st->n; x += b->w, i++) {
+        b = &st->blocks[i];
+        if (h && !strcmp(h->signal, b->signal)) {
+            h->x1 = x + b->w;
+            continue;
+        }
+        h = &st->hits[st->nhits++];
+        h->x0 = x;
+        h->x1 = x + b->w;
+        h->signal = b->signal;
+    }
 }
 
 // 点击状态栏时执行的func
@@ -1232,56 +1489,23 @@ clickstatusbar(const Arg *arg)
         return;
     lastclickstatusbartime = now;
 
-    int offset = -1;
-    int status_w = 0;
-    int iscode = 0, issignal = 0, signalindex = 0;
-    char signal [20];
-    char text [100];
+    int lo, hi, mid, len;
+    const char *signal = "";
+    char *text;
     char *button = "L";
-    int limit, max = sizeof(stext);
-
-    while (stext[++offset] != '\0') {
-        // 左侧^
-        if (stext[offset] == '^' && !iscode) {
-            iscode = 1;
-            offset++;
-            if (stext[offset] == 's') { // 查询到s->signal
-                issignal = 1;
-                signalindex = 0;
-                memset(signal, '\0', sizeof(signal));
-            } else {
-                issignal = 0;
-            }
-            continue;
-        }
-
-        // 右侧^
-        if (stext[offset] == '^' && iscode) {
-            iscode = 0;
-            issignal = 0;
-            continue;
-        }
-
-        if (issignal) { // 逐位读取signal
-            signal[signalindex++] = stext[offset];
-        }
-
-        // 是普通文本
-        if (!iscode) {
-            // 查找到下一个^ 或 游标到达最后
-            limit = 0;
-            while (stext[offset + ++limit] != '^' && offset + limit < max);
-            if (offset + limit == max)
-                break;
 
-            memset(text, '\0', sizeof(text));
-            strncpy(text, stext + offset, limit);
-            offset += --limit;
-            status_w += TEXTW(text) - lrpad;
-            if (status_w > arg->i)
-                break;
-        }
+    if (status->nhits < 0)
+        maphits(status);
+    // 找到第一个右边界大于点击位置的模块，超出时取最后一个
+    for (lo = 0, hi = status->nhits; lo < hi;) {
+        mid = (lo + hi) / 2;
+        if (status->hits[mid].x1 > arg->i)
+            hi = mid;
+        else
+            lo = mid + 1;
     }
+    if (status->nhits)
+        signal = status->hits[MIN(lo, status->nhits - 1)].signal;
 
     switch (arg->ui) {
         case Button1: button = "L"; break;
@@ -1291,9 +1515,11 @@ clickstatusbar(const Arg *arg)
         case Button5: button = "D"; break;
     }
 
-    memset(text, '\0', sizeof(text));
-    sprintf(text, "%s %s %s &", statusbarscript, signal, button);
+    len = snprintf(NULL, 0, "%s %s %s &", statusbarscript, signal, button) + 1;
+    text = ecalloc(len, 1);
+    snprintf(text, len, "%s %s %s &", statusbarscript, signal, button);
     system(text);
+    free(text);
 }
 
 void
@@ -1305,6 +1531,8 @@ enternotify(XEvent *e)
 
     if ((ev->mode != NotifyNormal || ev->detail == NotifyInferior) && ev->window != root)
         return;
+    if (ev->serial <= enterserial)
+        return;
     c = wintoclient(ev->window);
     m = c ? c->mon : wintomon(ev->window);
     if (m != selmon) {
@@ -1322,6 +1550,7 @@ expose(XEvent *e)
     XExposeEvent *ev = &e->xexpose;
 
     if (ev->count == 0 && (m = wintomon(ev->window))) {
+        invalidatebar(m);
         drawbar(m);
         if (m == selmon)
             updatesystray();
@@ -1378,33 +1607,38 @@ focusmon(const Arg *arg)
     pointerclient(NULL);
 }
 
+// 是否可被focusstack/focusdir选中
+int
+cyclable(Client *c, int issingle)
+{
+    return ISVISIBLE(c) && (issingle || !HIDDEN(c));
+}
+
 void
 focusstack(const Arg *arg)
 {
-    Client *tempClients[100];
-    Client *c = NULL, *tc = selmon->sel;
-    int last = -1, cur = 0, issingle = issinglewin(NULL);
+    Client *c = NULL, *t, *tc = selmon->sel;
+    int issingle = issinglewin(NULL);
 
     if (!tc)
         tc = selmon->clients;
     if (!tc)
         return;
 
-    for (c = selmon->clients; c; c = c->next) {
-        if (ISVISIBLE(c) && (issingle || !HIDDEN(c))) {
-            last ++;
-            tempClients[last] = c;
-            if (c == tc) cur = last;
-        }
-    }
-    if (last < 0) return;
-
+    // 沿可见链向前或向后找下一个可选窗口，到头后从另一端继续
     if (arg && arg->i == -1) {
-        if (cur - 1 >= 0) c = tempClients[cur - 1];
-        else c = tempClients[last];
+        for (t = visible(selmon); t && t != tc; t = t->vnext)
+            if (cyclable(t, issingle))
+                c = t;
+        if (!c)
+            for (; t; t = t->vnext)
+                if (cyclable(t, issingle))
+                    c = t;
     } else {
-        if (cur + 1 <= last) c = tempClients[cur + 1];
-        else c = tempClients[0];
+        for (t = visible(selmon); t && t != tc; t = t->vnext);
+        for (c = t ? t->vnext : NULL; c && !cyclable(c, issingle); c = c->vnext);
+        if (!c)
+            for (c = visible(selmon); c && !cyclable(c, issingle); c = c->vnext);
     }
 
     if (issingle) {
@@ -1421,6 +1655,7 @@ focusstack(const Arg *arg)
 void
 pointerclient(Client *c)
 {
+    flushdirty(); /* warp to where c actually is */
     if (c) {
         XWarpPointer(dpy, None, root, 0, 0, 0, 0, c->x + c->w / 2, c->y + c->h / 2);
         focus(c);
@@ -1484,32 +1719,108 @@ getsystraywidth()
 {
     unsigned int w = 0;
     Client *i;
-    if(showsystray)
+    if (!showsystray || !systray)
+        return 0;
+    if (systray->iconsw < 0) {
         for(i = systray->icons; i; w += MAX(i->w, bh) + systrayspacing, i = i->next) ;
-    return w ? w + systrayspacing : 0;
+        systray->iconsw = w ? w + systrayspacing : 0;
+    }
+    return systray->iconsw;
+}
+
+/* manage() sends the requests for every property it reads at once and only
+ * then waits for the replies, one round trip instead of one per property.
+ * Properties the window does not have come back as NULL. */
+void
+getprops(Window w, xcb_get_property_reply_t **r)
+{
+    /* lengths in 32 bit units, enough for what manage() looks at */
+    static const uint32_t len[PropLast] = { 2, 64, 64, 1, 1, 1, 18, 9, 64 };
+    xcb_get_property_cookie_t ck[PropLast];
+    Atom atoms[PropLast];
+    int i;
+
+    atoms[PropWMState] = wmatom[WMState];
+    atoms[PropNetWMName] = netatom[NetWMName];
+    atoms[PropWMName] = XA_WM_NAME;
+    atoms[PropTransient] = XA_WM_TRANSIENT_FOR;
+    atoms[PropNetWMState] = netatom[NetWMState];
+    atoms[PropWindowType] = netatom[NetWMWindowType];
+    atoms[PropNormalHints] = XA_WM_NORMAL_HINTS;
+    atoms[PropWMHints] = XA_WM_HINTS;
+    atoms[PropClass] = XA_WM_CLASS;
+    for (i = 0; i < PropLast; i++)
+        ck[i] = xcb_get_property(xcon, 0, w, atoms[i], XCB_GET_PROPERTY_TYPE_ANY, 0, len[i]);
+    for (i = 0; i < PropLast; i++)
+        if ((r[i] = xcb_get_property_reply(xcon, ck[i], NULL)) && r[i]->type == XCB_NONE) {
+            free(r[i]);
+            r[i] = NULL;
+        }
+}
+
+/* the values of a 32 bit property reply */
+uint32_t *
+prop32(xcb_get_property_reply_t *r, int *n)
+{
+    if (!r || r->format != 32) {
+        *n = 0;
+        return NULL;
+    }
+    *n = xcb_get_property_value_length(r) / 4;
+    return xcb_get_property_value(r);
 }
 
+/* gettextprop() for a property manage() already fetched */
 int
-gettextprop(Window w, Atom atom, char *text, unsigned int size)
+proptext(xcb_get_property_reply_t *r, char *text, unsigned int size)
 {
-    char **list = NULL;
-    int n;
     XTextProperty name;
 
-    if (!text || size == 0)
+    text[0] = '\0';
+    if (!r || r->format != 8)
         return 0;
+    name.value = xcb_get_property_value(r);
+    name.encoding = r->type;
+    name.format = r->format;
+    name.nitems = xcb_get_property_value_length(r);
+    return textprop(&name, text, size);
+}
+
+int
+textprop(XTextProperty *name, char *text, unsigned int size)
+{
+    char **list = NULL;
+    int n;
+
     text[0] = '\0';
-    if (!XGetTextProperty(dpy, w, &name, atom) || !name.nitems)
+    if (!name->nitems)
         return 0;
-    if (name.encoding == XA_STRING)
-        strncpy(text, (char *)name.value, size - 1);
-    else {
-        if (XmbTextPropertyToTextList(dpy, &name, &list, &n) >= Success && n > 0 && *list) {
+    if (name->encoding == XA_STRING) {
+        /* the value is not terminated when it comes from proptext() */
+        n = MIN(name->nitems, size - 1);
+        memcpy(text, name->value, n);
+        text[n] = '\0';
+    } else {
+        if (XmbTextPropertyToTextList(dpy, name, &list, &n) >= Success && n > 0 && *list) {
             strncpy(text, *list, size - 1);
             XFreeStringList(list);
         }
     }
     text[size - 1] = '\0';
+    return 1;
+}
+
+int
+gettextprop(Window w, Atom atom, char *text, unsigned int size)
+{
+    XTextProperty name;
+
+    if (!text || size == 0)
+        return 0;
+    text[0] = '\0';
+    if (!XGetTextProperty(dpy, w, &name, atom) || !name.nitems)
+        return 0;
+    textprop(&name, text, size);
     XFree(name.value);
     return 1;
 }
@@ -1517,7 +1828,6 @@ gettextprop(Window w, Atom atom, char *text, unsigned int size)
 void
 grabbuttons(Client *c, int focused)
 {
-    updatenumlockmask();
     {
         unsigned int i, j;
         unsigned int modifiers[] = { 0, LockMask, numlockmask, numlockmask|LockMask };
@@ -1558,44 +1868,73 @@ hide(Client *c) {
     if (!c || HIDDEN(c))
         return;
 
-    Window w = c->win;
-    static XWindowAttributes ra, ca;
-
     // more or less taken directly from blackbox's hide() function
     XGrabServer(dpy);
-    XGetWindowAttributes(dpy, root, &ra);
-    XGetWindowAttributes(dpy, w, &ca);
     // prevent UnmapNotify events
-    XSelectInput(dpy, root, ra.your_event_mask & ~SubstructureNotifyMask);
-    XSelectInput(dpy, w, ca.your_event_mask & ~StructureNotifyMask);
-    XUnmapWindow(dpy, w);
-    setclientstate(c, IconicState);
-    XSelectInput(dpy, root, ra.your_event_mask);
-    XSelectInput(dpy, w, ca.your_event_mask);
+    XSelectInput(dpy, root, ROOTMASK & ~SubstructureNotifyMask);
+    hideclient(c);
+    XSelectInput(dpy, root, ROOTMASK);
     XUngrabServer(dpy);
 
-    hiddenWinStack[++hiddenWinStackTop] = c;
     focus(c->snext);
     arrange(c->mon);
 }
 
+// 取消映射窗口并压入隐藏栈，调用方需已持有grab并屏蔽root的SubstructureNotify
+void
+hideclient(Client *c)
+{
+    XSelectInput(dpy, c->win, CLIENTMASK & ~StructureNotifyMask);
+    XUnmapWindow(dpy, c->win);
+    setclientstate(c, IconicState);
+    XSelectInput(dpy, c->win, CLIENTMASK);
+
+    pophidden(c);
+    if (hiddenWinStackTop + 1 < (int)LENGTH(hiddenWinStack))
+        hiddenWinStack[++hiddenWinStackTop] = c;
+}
+
 void
 hideotherwins(const Arg *arg) {
     Client *c = (Client*)arg->v, *tc = NULL;
-    for (tc = selmon->clients; tc; tc = tc->next)
-        if (tc != c && ISVISIBLE(tc))
-            hide(tc);
-    show(c);
+    int n = 0;
+
+    // 一次grab内隐藏所有其他窗口，最后只arrange一次
+    for (tc = visible(selmon); tc; tc = tc->vnext) {
+        if (tc == c || HIDDEN(tc))
+            continue;
+        if (!n++) {
+            XGrabServer(dpy);
+            XSelectInput(dpy, root, ROOTMASK & ~SubstructureNotifyMask);
+        }
+        hideclient(tc);
+    }
+    if (n) {
+        XSelectInput(dpy, root, ROOTMASK);
+        XUngrabServer(dpy);
+    }
+    if (HIDDEN(c)) {
+        showclient(c);
+        n++;
+    }
+    if (n)
+        arrange(selmon);
     focus(c);
 }
 
 void
 showonlyorall(const Arg *arg) {
     Client *c;
+    int n = 0;
+
     if (issinglewin(NULL) || !selmon->sel) {
-        for (c = selmon->clients; c; c = c->next)
-            if (ISVISIBLE(c))
-                show(c);
+        for (c = visible(selmon); c; c = c->vnext)
+            if (HIDDEN(c)) {
+                showclient(c);
+                n++;
+            }
+        if (n)
+            arrange(selmon);
     } else
         hideotherwins(&(Arg) { .v = selmon->sel });
 }
@@ -1658,8 +1997,8 @@ killclient(const Arg *arg)
         XSetErrorHandler(xerror);
         XUngrabServer(dpy);
     }
-    for (c = selmon->clients; c; c = c->next)
-        if (ISVISIBLE(c) && !HIDDEN(c))
+    for (c = visible(selmon); c; c = c->vnext)
+        if (!HIDDEN(c))
             n++;
     if (n <= 1)
         focusstack(NULL);
@@ -1685,8 +2024,8 @@ managefloating(Client *c)
         int dw, dh, existed = 0;
         dw = (selmon->ww / 20) * d1, dh = (selmon->wh / 20) * d2;
         tx = c->x + dw, ty = c->y + dh;
-        for (tc = selmon->clients; tc; tc = tc->next) {
-            if (ISVISIBLE(tc) && !HIDDEN(tc) && tc != c && tc->x == tx && tc->y == ty) {
+        for (tc = visible(selmon); tc; tc = tc->vnext) {
+            if (!HIDDEN(tc) && tc != c && tc->x == tx && tc->y == ty) {
                 existed = 1;
                 break;
             }
@@ -1707,8 +2046,17 @@ manage(Window w, XWindowAttributes *wa)
 {
     Client *c, *t = NULL;
     Window trans = None;
+    Atom state;
     XWindowChanges wc;
+    XSizeHints size;
+    XWMHints wmh;
+    xcb_get_property_reply_t *r[PropLast];
+    uint32_t *v;
+    int i, n;
+    char cls[257];
+    const char *class = broken, *instance = broken;
 
+    getprops(w, r);
     c = ecalloc(1, sizeof(Client));
     c->win = w;
     /* geometry */
@@ -1718,15 +2066,31 @@ manage(Window w, XWindowAttributes *wa)
     c->h = c->oldh = wa->height;
     c->oldbw = wa->border_width;
     c->bw = borderpx;
+    c->state = (v = prop32(r[PropWMState], &n)) && n ? (long)v[0] : -1;
 
-    updatetitle(c);
+    if (!proptext(r[PropNetWMName], c->name, sizeof c->name))
+        proptext(r[PropWMName], c->name, sizeof c->name);
+    if (c->name[0] == '\0') /* hack to mark broken clients */
+        strcpy(c->name, broken);
     // managetransientwin 管理transient window，此时transient window也会调用applyrules
-    if (!managetransientwin && XGetTransientForHint(dpy, w, &trans) && (t = wintoclient(trans))) {
+    if (!managetransientwin && (v = prop32(r[PropTransient], &n)) && n)
+        trans = v[0];
+    if (trans != None && (t = wintoclient(trans))) {
         c->mon = t->mon;
         c->tags = t->tags;
     } else {
+        // WM_CLASS为"instance\0class\0"
+        if (r[PropClass] && r[PropClass]->format == 8) {
+            n = MIN(xcb_get_property_value_length(r[PropClass]), (int)sizeof cls - 1);
+            memcpy(cls, xcb_get_property_value(r[PropClass]), n);
+            cls[n] = '\0';
+            if (cls[0])
+                instance = cls;
+            if ((i = strlen(cls) + 1) < n && cls[i])
+                class = cls + i;
+        }
         c->mon = selmon;
-        applyrules(c);
+        applyrules(c, class, instance);
     }
     wc.border_width = c->bw;
 
@@ -1755,20 +2119,71 @@ manage(Window w, XWindowAttributes *wa)
     XConfigureWindow(dpy, w, CWBorderWidth, &wc);
     XSetWindowBorder(dpy, w, scheme[SchemeNorm][ColBorder].pixel);
     configure(c); /* propagates border_width, if size doesn't change */
-    updatewindowtype(c);
-    updatesizehints(c);
-    updatewmhints(c);
-    XSelectInput(dpy, w, EnterWindowMask|FocusChangeMask|PropertyChangeMask|StructureNotifyMask);
+    /* absent or malformed hints leave the zeroed defaults from ecalloc */
+    if (r[PropNetWMState] || r[PropWindowType]) {
+        v = prop32(r[PropNetWMState], &n);
+        state = v && n ? v[0] : None;
+        v = prop32(r[PropWindowType], &n);
+        setwindowtype(c, state, v && n ? v[0] : None);
+    }
+    /* same layouts XGetWMNormalHints() and XGetWMHints() read */
+    if ((v = prop32(r[PropNormalHints], &n)) && n >= 15) {
+        size.flags = v[0];
+        size.x = (int32_t)v[1];
+        size.y = (int32_t)v[2];
+        size.width = (int32_t)v[3];
+        size.height = (int32_t)v[4];
+        size.min_width = (int32_t)v[5];
+        size.min_height = (int32_t)v[6];
+        size.max_width = (int32_t)v[7];
+        size.max_height = (int32_t)v[8];
+        size.width_inc = (int32_t)v[9];
+        size.height_inc = (int32_t)v[10];
+        size.min_aspect.x = (int32_t)v[11];
+        size.min_aspect.y = (int32_t)v[12];
+        size.max_aspect.x = (int32_t)v[13];
+        size.max_aspect.y = (int32_t)v[14];
+        if (n >= 18) {
+            size.base_width = (int32_t)v[15];
+            size.base_height = (int32_t)v[16];
+            size.win_gravity = (int32_t)v[17];
+        } else
+            size.flags &= ~(PBaseSize|PWinGravity);
+        setsizehints(c, &size);
+    }
+    if ((v = prop32(r[PropWMHints], &n)) && n >= 8) {
+        memset(&wmh, 0, sizeof wmh);
+        wmh.flags = v[0];
+        wmh.input = (Bool)v[1];
+        wmh.initial_state = (int32_t)v[2];
+        wmh.icon_pixmap = v[3];
+        wmh.icon_window = v[4];
+        wmh.icon_x = (int32_t)v[5];
+        wmh.icon_y = (int32_t)v[6];
+        wmh.icon_mask = v[7];
+        if (n >= 9)
+            wmh.window_group = v[8];
+        else
+            wmh.flags &= ~WindowGroupHint;
+        setwmhints(c, &wmh);
+    }
+    for (i = 0; i < PropLast; i++)
+        free(r[i]);
+    XSelectInput(dpy, w, CLIENTMASK);
     grabbuttons(c, 0);
     if (!c->isfloating)
         c->isfloating = c->oldstate = trans != None || c->isfixed;
     if (c->isfloating)
         XRaiseWindow(dpy, c->win);
+    invalidatestack(NULL); /* new windows start on top of the stack */
     attach(c);
     attachstack(c);
+    regwin(c->win, WinClient, c);
     XChangeProperty(dpy, root, netatom[NetClientList], XA_WINDOW, 32, PropModeAppend,
             (unsigned char *) &(c->win), 1);
     XMoveResizeWindow(dpy, c->win, c->x + 2 * sw, c->y, c->w, c->h); /* some windows require this */
+    c->sentx = c->x + 2 * sw;
+    c->senty = c->y;
     if (!HIDDEN(c))
         setclientstate(c, NormalState);
     if (c->mon == selmon)
@@ -1788,6 +2203,8 @@ mappingnotify(XEvent *e)
     XRefreshKeyboardMapping(ev);
     if (ev->request == MappingKeyboard)
         grabkeys();
+    else if (ev->request == MappingModifier)
+        updatenumlockmask();
 }
 
 void
@@ -1849,6 +2266,7 @@ movemouse(const Arg *arg)
     if (!getrootptr(&x, &y))
         return;
     do {
+        flushdirty();
         XMaskEvent(dpy, MOUSEMASK|ExposureMask|SubstructureRedirectMask, &ev);
         switch(ev.type) {
             case ConfigureRequest:
@@ -1910,9 +2328,9 @@ movewin(const Arg *arg)
             tar = -99999;
             top = c->y;
             ny -= c->mon->wh / 4;
-            for (tc = c->mon->clients; tc; tc = tc->next) {
+            for (tc = visible(c->mon); tc; tc = tc->vnext) {
                 // 若浮动tc c的顶边会穿过tc的底边 
-                if (!ISVISIBLE(tc) || !tc->isfloating || tc == c) continue;
+                if (!tc->isfloating || tc == c) continue;
                 if (c->x + WIDTH(c) < tc->x || c->x > tc->x + WIDTH(tc)) continue;
                 buttom = tc->y + HEIGHT(tc) + gappi;  
                 if (top > buttom && ny < buttom) {  
@@ -1926,9 +2344,9 @@ movewin(const Arg *arg)
             tar = 99999;
             buttom = c->y + HEIGHT(c);
             ny += c->mon->wh / 4;
-            for (tc = c->mon->clients; tc; tc = tc->next) {
+            for (tc = visible(c->mon); tc; tc = tc->vnext) {
                 // 若浮动tc c的底边会穿过tc的顶边 
-                if (!ISVISIBLE(tc) || !tc->isfloating || tc == c) continue;
+                if (!tc->isfloating || tc == c) continue;
                 if (c->x + WIDTH(c) < tc->x || c->x > tc->x + WIDTH(tc)) continue;
                 top = tc->y - gappi;
                 if (buttom < top && (ny + HEIGHT(c)) > top) {  
@@ -1942,9 +2360,9 @@ movewin(const Arg *arg)
             tar = -99999;
             left = c->x;
             nx -= c->mon->ww / 6;
-            for (tc = c->mon->clients; tc; tc = tc->next) {
+            for (tc = visible(c->mon); tc; tc = tc->vnext) {
                 // 若浮动tc c的左边会穿过tc的右边 
-                if (!ISVISIBLE(tc) || !tc->isfloating || tc == c) continue;
+                if (!tc->isfloating || tc == c) continue;
                 if (c->y + HEIGHT(c) < tc->y || c->y > tc->y + HEIGHT(tc)) continue;
                 right = tc->x + WIDTH(tc) + gappi;
                 if (left > right && nx < right) {
@@ -1958,9 +2376,9 @@ movewin(const Arg *arg)
             tar = 99999;
             right = c->x + WIDTH(c);
             nx += c->mon->ww / 6;
-            for (tc = c->mon->clients; tc; tc = tc->next) {
+            for (tc = visible(c->mon); tc; tc = tc->vnext) {
                 // 若浮动tc c的右边会穿过tc的左边 
-                if (!ISVISIBLE(tc) || !tc->isfloating || tc == c) continue;
+                if (!tc->isfloating || tc == c) continue;
                 if (c->y + HEIGHT(c) < tc->y || c->y > tc->y + HEIGHT(tc)) continue;
                 left = tc->x - gappi;
                 if (right < left && (nx + WIDTH(c)) > left) {
@@ -1994,9 +2412,9 @@ resizewin(const Arg *arg)
             tar = 99999;
             right = c->x + WIDTH(c);
             nw += selmon->ww / 16;
-            for (tc = c->mon->clients; tc; tc = tc->next) {
+            for (tc = visible(c->mon); tc; tc = tc->vnext) {
                 // 若浮动tc c的右边会穿过tc的左边 
-                if (!ISVISIBLE(tc) || !tc->isfloating || tc == c) continue;
+                if (!tc->isfloating || tc == c) continue;
                 if (c->y + HEIGHT(c) < tc->y || c->y > tc->y + HEIGHT(tc)) continue;
                 left = tc->x - gappi;
                 if (right < left && (c->x + nw) > left) {
@@ -2015,9 +2433,9 @@ resizewin(const Arg *arg)
             tar = -99999;
             buttom = c->y + HEIGHT(c);
             nh += selmon->wh / 8;
-            for (tc = c->mon->clients; tc; tc = tc->next) {
+            for (tc = visible(c->mon); tc; tc = tc->vnext) {
                 // 若浮动tc c的底边会穿过tc的顶边 
-                if (!ISVISIBLE(tc) || !tc->isfloating || tc == c) continue;
+                if (!tc->isfloating || tc == c) continue;
                 if (c->x + WIDTH(c) < tc->x || c->x > tc->x + WIDTH(tc)) continue;
                 top = tc->y - gappi;
                 if (buttom < top && (c->y + nh) > top) {  
@@ -2041,16 +2459,35 @@ resizewin(const Arg *arg)
 Client *
 nexttiled(Client *c)
 {
-    for (; c && (c->isfloating || !ISVISIBLE(c) || HIDDEN(c)); c = c->next);
+    for (; c && (c->isfloating || HIDDEN(c)); c = c->vnext);
     return c;
 }
 
+/* the visible clients of m chained through vnext, rebuilt only after the
+ * client list, a client's tags or the monitor's tagset changed */
+Client *
+visible(Monitor *m)
+{
+    Client *c, **tc;
+
+    if (m->visok && m->vistags == m->tagset[m->seltags])
+        return m->vis;
+    for (tc = &m->vis, c = m->clients; c; c = c->next)
+        if (ISVISIBLE(c)) {
+            *tc = c;
+            tc = &c->vnext;
+        }
+    *tc = NULL;
+    m->vistags = m->tagset[m->seltags];
+    m->visok = 1;
+    return m->vis;
+}
+
 void
 pop(Client *c)
 {
 	detach(c);
-    c->next = c->mon->clients;
-    c->mon->clients = c;
+    attachhead(c);
 	focus(c);
 	arrange(c->mon);
     pointerclient(c);
@@ -2075,6 +2512,8 @@ propertynotify(XEvent *e)
     }
     if ((ev->window == root) && (ev->atom == XA_WM_NAME))
         updatestatus();
+    else if (ev->atom == wmatom[WMState] && (c = wintoclient(ev->window)))
+        c->state = ev->state == PropertyDelete ? -1 : getstate(c->win); // 删除时缓存也要失效
     else if (ev->state == PropertyDelete)
         return; /* ignore */
     else if ((c = wintoclient(ev->window))) {
@@ -2133,6 +2572,8 @@ removesystrayicon(Client *i)
     for (ii = &systray->icons; *ii && *ii != i; ii = &(*ii)->next);
     if (ii)
         *ii = i->next;
+    systray->iconsw = -1;
+    unregwin(i->win);
     free(i);
 }
 
@@ -2151,13 +2592,20 @@ resizebarwin(Monitor *m) {
     uint system_w = getsystraywidth();
     if (showsystray && m == systraytomon(m))
         w -= system_w;
-    XMoveResizeWindow(dpy, m->barwin, m->wx + sp, m->by + vp, w -  2 * sp - (m == systraytomon(m) && system_w ? systrayspadding : 0), bh); // 如果托盘存在 额外减去systrayspadding
+    w = w -  2 * sp - (m == systraytomon(m) && system_w ? systrayspadding : 0); // 如果托盘存在 额外减去systrayspadding
+    if (m->barx == m->wx + sp && m->bary == m->by + vp && m->barw == w)
+        return;
+    m->barx = m->wx + sp;
+    m->bary = m->by + vp;
+    m->barw = w;
+    XMoveResizeWindow(dpy, m->barwin, m->barx, m->bary, m->barw, bh);
 }
 
 void
 resizeclient(Client *c, int x, int y, int w, int h)
 {
     XWindowChanges wc;
+    unsigned long first = NextRequest(dpy);
 
     c->oldx = c->x; c->x = wc.x = x;
     c->oldy = c->y; c->y = wc.y = y;
@@ -2165,15 +2613,17 @@ resizeclient(Client *c, int x, int y, int w, int h)
     c->oldh = c->h; c->h = wc.height = h;
     wc.border_width = c->bw;
 
-    if (((nexttiled(c->mon->clients) == c && !nexttiled(c->next)))
+    if (((nexttiled(visible(c->mon)) == c && !nexttiled(c->vnext)))
             && !c->isfullscreen && !c->isfloating) {
         c->w = wc.width += c->bw * 2;
         c->h = wc.height += c->bw * 2;
         wc.border_width = 0;
     }
     XConfigureWindow(dpy, c->win, CWX|CWY|CWWidth|CWHeight|CWBorderWidth, &wc);
+    c->sentx = wc.x;
+    c->senty = wc.y;
     configure(c);
-    XSync(dpy, False);
+    trackreqs(first, "resizeclient", 0);
 }
 
 void
@@ -2197,6 +2647,7 @@ resizemouse(const Arg *arg)
         return;
     XWarpPointer(dpy, None, c->win, 0, 0, 0, 0, c->w + c->bw - 1, c->h + c->bw - 1);
     do {
+        flushdirty();
         XMaskEvent(dpy, MOUSEMASK|ExposureMask|SubstructureRedirectMask, &ev);
         switch(ev.type) {
             case ConfigureRequest:
@@ -2248,36 +2699,267 @@ resizerequest(XEvent *e)
 
 void
 restack(Monitor *m)
+{
+    markdirty(m, DirtyRestack|DirtyBar);
+}
+
+void
+restackmon(Monitor *m)
 {
     Client *c;
-    XEvent ev;
-    XWindowChanges wc;
+    unsigned int n = 1, changed;
+    unsigned long first = NextRequest(dpy);
 
-    drawbar(m);
     if (!m->sel)
         return;
-    if (m->sel->isfloating)
-        XRaiseWindow(dpy, m->sel->win);
-    wc.stack_mode = Below;
-    wc.sibling = m->barwin;
     for (c = m->stack; c; c = c->snext)
+        if (!c->isfloating && ISVISIBLE(c))
+            n++;
+    if (n > m->stackcap) {
+        m->stackcap = n * 2;
+        if (!(m->stackwins = realloc(m->stackwins, m->stackcap * sizeof(Window))))
+            die("realloc:");
+    }
+    /* the bar on top, tiled clients below it in focus order; the order is
+     * kept in stackwins so an unchanged stack costs no requests at all */
+    changed = n != m->nstack || m->stackwins[0] != m->barwin;
+    m->stackwins[0] = m->barwin;
+    for (n = 1, c = m->stack; c; c = c->snext)
         if (!c->isfloating && ISVISIBLE(c)) {
-            XConfigureWindow(dpy, c->win, CWSibling|CWStackMode, &wc);
-            wc.sibling = c->win;
+            changed |= m->stackwins[n] != c->win;
+            m->stackwins[n++] = c->win;
         }
-    XSync(dpy, False);
-    while (XCheckMaskEvent(dpy, EnterWindowMask, &ev));
+    m->nstack = n;
+    if (changed) /* the raised client may have been tiled in the meantime */
+        m->raised = None;
+    if (m->sel->isfloating && m->raised != m->sel->win) {
+        XRaiseWindow(dpy, m->sel->win);
+        m->raised = m->sel->win;
+    }
+    if (changed)
+        XRestackWindows(dpy, m->stackwins, n);
+    trackreqs(first, "restack", 0);
+}
+
+/* forget the stacking order restackmon() last sent after something else
+ * changed it, NULL for all monitors */
+void
+invalidatestack(Monitor *m)
+{
+    Monitor *mon;
+
+    for (mon = m ? m : mons; mon; mon = m ? NULL : mon->next) {
+        mon->nstack = 0;
+        mon->raised = None;
+    }
+}
+
+/* handlers only record what has to be redone, flushdirty() then arranges,
+ * restacks and redraws each monitor at most once per batch of events */
+void
+markdirty(Monitor *m, unsigned int flags)
+{
+    if (m)
+        m->dirty |= flags;
+    else for (m = mons; m; m = m->next)
+        m->dirty |= flags;
+}
+
+void
+flushdirty(void)
+{
+    Monitor *m;
+    unsigned int dirty, moved = 0;
+
+    for (m = mons; m; m = m->next)
+        if (m->dirty & DirtyArrange)
+            showtag(m->stack);
+    for (m = mons; m; m = m->next) {
+        if (!(dirty = m->dirty))
+            continue;
+        m->dirty = 0;
+        moved |= dirty & (DirtyArrange|DirtyRestack);
+        if (dirty & DirtyArrange)
+            arrangemon(m);
+        if (dirty & DirtyRestack)
+            restackmon(m);
+        if (dirty & DirtyBar)
+            renderbar(m);
+    }
+    if (moved) {
+        /* crossing events caused by moving and restacking windows above
+         * carry at most this serial, enternotify() drops them instead of
+         * syncing and draining. The no-op moves the server past it, so
+         * crossings that happen afterwards get a higher serial even when
+         * nothing else follows */
+        enterserial = NextRequest(dpy) - 1;
+        XNoOp(dpy);
+    }
+    XFlush(dpy);
 }
 
 void
 run(void)
 {
     XEvent ev;
+    Monitor *m;
+    fd_set fds;
+    int n, left, skip, xfd = ConnectionNumber(dpy), ffd = drw_fontset_fd(drw);
+
     /* main event loop */
     XSync(dpy, False);
-    while (running && !XNextEvent(dpy, &ev))
-        if (handler[ev.type])
-            handler[ev.type](&ev); /* call handler */
+    while (running) {
+        flushdirty();
+        /* take whatever is queued as one batch, block only when idle */
+        if (!(n = XEventsQueued(dpy, QueuedAfterReading))) {
+            /* also wake up for fallback fonts found off the event loop */
+            FD_ZERO(&fds);
+            FD_SET(xfd, &fds);
+            FD_SET(ffd, &fds);
+            if (select(MAX(xfd, ffd) + 1, &fds, NULL, NULL, NULL) < 0) {
+                if (errno != EINTR)
+                    die("select:");
+                continue; /* fds is undefined after a failed select */
+            }
+            if (FD_ISSET(ffd, &fds) && drw_fontset_poll(drw)) {
+                parsestatus(); // 字宽已变化
+                for (m = mons; m; m = m->next)
+                    invalidatebar(m);
+                drawbars();
+            }
+            continue;
+        }
+        if (n > 1)
+            scanqueue();
+        else
+            nqueued = 0;
+        /* handlers may consume events themselves, so recheck the queue */
+        while (running && n-- > 0 && (left = XEventsQueued(dpy, QueuedAlready))) {
+            XNextEvent(dpy, &ev);
+            skip = superseded(&ev); /* also keeps the scan in step */
+            if (handler[ev.type] && !skip)
+                handler[ev.type](&ev); /* call handler */
+            if (XEventsQueued(dpy, QueuedAlready) < left - 1)
+                nqueued = 0; /* the handler took events out of the queue */
+        }
+    }
+}
+
+/* what a queued event has to share with a later one to be superseded by
+ * it, besides type and window; 0 for events that are always handled, 2 for
+ * events that end the run of ConfigureRequests for *sub */
+int
+coalescekey(XEvent *ev, Window *sub)
+{
+    switch (ev->type) {
+        case MapRequest:
+            *sub = ev->xmaprequest.window;
+            return 2;
+        case UnmapNotify:
+            *sub = ev->xunmap.window;
+            return 2;
+        case DestroyNotify:
+            *sub = ev->xdestroywindow.window;
+            return 2;
+        case PropertyNotify:
+            *sub = ev->xproperty.atom;
+            return 1;
+        case ConfigureRequest: /* xany.window is the parent here */
+            *sub = ev->xconfigurerequest.window;
+            return 1;
+        case ConfigureNotify:
+            *sub = ev->xconfigure.window;
+            return 1;
+        case Expose:
+        case MotionNotify:
+            *sub = None;
+            return 1;
+    }
+    *sub = None;
+    return 0;
+}
+
+/* predicate for XCheckIfEvent, never matches so nothing is dequeued */
+Bool
+recordevent(Display *dpy, XEvent *ev, XPointer arg)
+{
+    Queued *q;
+
+    if (nqueued == queuedcap) {
+        queuedcap = queuedcap ? queuedcap * 2 : 64;
+        if (!(queued = realloc(queued, queuedcap * sizeof(Queued))))
+            die("realloc:");
+    }
+    q = &queued[nqueued++];
+    q->type = ev->type;
+    q->win = ev->xany.window;
+    q->serial = ev->xany.serial;
+    q->key = coalescekey(ev, &q->sub);
+    /* a ConfigureRequest matches on the window it configures only, and so
+     * does a map, unmap or destroy of that window that ends the run */
+    q->ktype = q->key == 2 ? ConfigureRequest : q->type;
+    q->kwin = q->ktype == ConfigureRequest ? None : q->win;
+    q->mask = ev->type == ConfigureRequest ? ev->xconfigurerequest.value_mask : 0;
+    q->skip = 0;
+    return False;
+}
+
+/* One walk over the queue marks every event that a later queued event for
+ * the same window (and atom) makes redundant, e.g. a burst of title updates.
+ * A window's ConfigureRequests are not coalesced across its (un)mapping.
+ * run() then skips those as it dispatches the batch. */
+void
+scanqueue(void)
+{
+    static unsigned int *slots, nslots;
+    unsigned int i, j, size, h;
+    Queued *q, *l;
+    XEvent dummy;
+
+    nqueued = queuedpos = 0;
+    XCheckIfEvent(dpy, &dummy, recordevent, NULL);
+    for (size = 16; size < 2 * nqueued; size <<= 1);
+    if (size > nslots) {
+        nslots = size;
+        free(slots);
+        slots = ecalloc(nslots, sizeof(unsigned int));
+    }
+    memset(slots, 0, size * sizeof(unsigned int));
+    /* from the back, so the first event seen for a key is the latest one */
+    for (i = nqueued; i-- > 0;) {
+        q = &queued[i];
+        if (!q->key)
+            continue;
+        h = (q->ktype * 31 + q->kwin * 2654435761u + q->sub) & (size - 1);
+        for (j = h; slots[j]; j = (j + 1) & (size - 1)) {
+            l = &queued[slots[j] - 1];
+            if (l->ktype == q->ktype && l->kwin == q->kwin && l->sub == q->sub)
+                break;
+        }
+        if (!slots[j] || q->key == 2 || l->key == 2)
+            slots[j] = i + 1; /* nothing to coalesce with across a map, unmap or destroy */
+        else if (q->type != ConfigureRequest || (l->mask & q->mask) == q->mask)
+            q->skip = 1;
+    }
+}
+
+/* whether scanqueue() found ev, the next event of the batch, superseded */
+int
+superseded(XEvent *ev)
+{
+    Queued *q;
+    Window sub;
+
+    if (queuedpos >= nqueued)
+        return 0;
+    q = &queued[queuedpos++];
+    coalescekey(ev, &sub);
+    if (q->type != ev->type || q->win != ev->xany.window
+            || q->serial != ev->xany.serial || q->sub != sub) {
+        nqueued = 0; /* out of step with the queue, stop trusting the scan */
+        return 0;
+    }
+    return q->skip;
 }
 
 void
@@ -2335,6 +3017,7 @@ setclientstate(Client *c, long state)
 {
     long data[] = { state, None };
 
+    c->state = state;
     XChangeProperty(dpy, c->win, wmatom[WMState], wmatom[WMState], 32,
             PropModeReplace, (unsigned char *)data, 2);
 }
@@ -2417,6 +3100,7 @@ setfullscreen(Client *c, int fullscreen)
         c->isfloating = 1;
         resizeclient(c, c->mon->mx, c->mon->my, c->mon->mw, c->mon->mh);
         XRaiseWindow(dpy, c->win);
+        invalidatestack(c->mon);
     } else if (!fullscreen && c->isfullscreen){
         XChangeProperty(dpy, c->win, netatom[NetWMState], XA_ATOM, 32,
                 PropModeReplace, (unsigned char*)0, 0);
@@ -2498,9 +3182,11 @@ setup(void)
     sh = DisplayHeight(dpy, screen);
     root = RootWindow(dpy, screen);
     xinitvisual();
-    drw = drw_create(dpy, screen, root, sw, sh, visual, depth, cmap);
+    /* bars draw into their own m->barbuf, drw's pixmap is only a fallback */
+    drw = drw_create(dpy, screen, root, 1, 1, visual, depth, cmap);
     if (!drw_fontset_create(drw, fonts, LENGTH(fonts)))
         die("no fonts could be loaded.");
+    drw_settextcache(drw, (size_t)textcachesize * 1024);
     lrpad = drw->fonts->h;
     bh = drw->fonts->h + 2;
 	sp = sidepad;
@@ -2556,9 +3242,7 @@ setup(void)
     XDeleteProperty(dpy, root, netatom[NetClientList]);
     /* select events */
     wa.cursor = cursor[CurNormal]->cursor;
-    wa.event_mask = SubstructureRedirectMask|SubstructureNotifyMask
-        |ButtonPressMask|PointerMotionMask|EnterWindowMask
-        |LeaveWindowMask|StructureNotifyMask|PropertyChangeMask;
+    wa.event_mask = ROOTMASK;
     XChangeWindowAttributes(dpy, root, CWEventMask|CWCursor, &wa);
     XSelectInput(dpy, root, wa.event_mask);
     grabkeys();
@@ -2571,7 +3255,7 @@ seturgent(Client *c, int urg)
 {
     XWMHints *wmh;
 
-    c->isurgent = urg;
+    retag(c, c->tags, c->isglobal, urg);
     if (!(wmh = XGetWMHints(dpy, c->win)))
         return;
     wmh->flags = urg ? (wmh->flags | XUrgencyHint) : (wmh->flags & ~XUrgencyHint);
@@ -2585,61 +3269,87 @@ show(Client *c)
     if (!c || !HIDDEN(c))
         return;
 
+    showclient(c);
+    arrange(c->mon);
+}
+
+void
+showclient(Client *c)
+{
     XMapWindow(dpy, c->win);
     setclientstate(c, NormalState);
+    pophidden(c);
+    invalidatestack(c->mon); /* mapped on top of the stack */
+}
+
+// 从隐藏栈中移除指定窗口
+void
+pophidden(Client *c)
+{
+    int i;
+
+    for (i = hiddenWinStackTop; i >= 0 && hiddenWinStack[i] != c; i--);
+    if (i < 0)
+        return;
+    for (; i < hiddenWinStackTop; i++)
+        hiddenWinStack[i] = hiddenWinStack[i + 1];
     hiddenWinStackTop--;
-    arrange(c->mon);
 }
 
 // 该方法为显示当前tag下的窗口的func，切换时会将原窗口下的win放到屏幕之外
+// 仅当位置与上次发送的不同时才移动窗口
+void
+sendmove(Client *c, int x, int y)
+{
+    if (c->sentx == x && c->senty == y)
+        return;
+    XMoveWindow(dpy, c->win, x, y);
+    c->sentx = x;
+    c->senty = y;
+}
+
 void
 showtag(Client *c)
 {
-    if (!c) return;
+    Client *s;
+    Monitor *m;
 
-    if (ISVISIBLE(c)) {
-        XMoveWindow(dpy, c->win, c->x, c->y);
-        if (c->isfloating && !c->isfullscreen) resize(c, c->x, c->y, c->w, c->h, 0);
+    // 先由上至下显示可见窗口，再隐藏其余窗口
+    for (s = c; s; s = s->snext)
+        if (ISVISIBLE(s)) {
+            sendmove(s, s->x, s->y);
+            if (s->isfloating && !s->isfullscreen) resize(s, s->x, s->y, s->w, s->h, 0);
+        }
 
-        showtag(c->snext);
-    } else {
-        showtag(c->snext);
-
-        // 获取mon数量
-        int monitor_count = 0;
-        int maxmx = 0;
-        int maxmb = 0; // 最大的bottom
-        for (Monitor *m = mons; m; m = m->next) {
-            monitor_count++;
-            if (m->my + m->mh > maxmb) maxmb = m->my + m->mh;
-            if (m->mx > maxmx) maxmx = m->mx;
-        };
-
-        if (monitor_count == 1) {
+    for (s = c; s; s = s->snext) {
+        if (ISVISIBLE(s))
+            continue;
+        m = s->mon;
+        if (moncount == 1) {
             // 仅单个mon时，按tag大小觉得从左边或右边显示
-            unsigned int only_tag = (c->tags & (c->tags - 1)) == 0;
-            if (only_tag && (TAGMASK & c->tags) >= 1 << c->mon->pertag->curtag) XMoveWindow(dpy, c->win, c->x + c->mon->mx + c->mon->mw, c->y);
+            unsigned int only_tag = (s->tags & (s->tags - 1)) == 0;
+            if (only_tag && (TAGMASK & s->tags) >= 1 << m->pertag->curtag) sendmove(s, s->x + m->mx + m->mw, s->y);
             else {
-                if (c->x + c->w > c->mon->mx + c->mon->mw) XMoveWindow(dpy, c->win, -1 * WIDTH(c), c->y);
-                else XMoveWindow(dpy, c->win, c->x + c->mon->mx - c->mon->mw, c->y);
+                if (s->x + s->w > m->mx + m->mw) sendmove(s, -1 * WIDTH(s), s->y);
+                else sendmove(s, s->x + m->mx - m->mw, s->y);
             }
-        } else if (monitor_count == 2) {
+        } else if (moncount == 2) {
             // 两个mon时，左边窗口的mon藏在左边，右边窗口的mon藏在右边
-            if (c->mon->mx == 0) {
-                XMoveWindow(dpy, c->win, c->mon->mw * -1, c->y);
+            if (m->mx == 0) {
+                sendmove(s, m->mw * -1, s->y);
             } else {
-                XMoveWindow(dpy, c->win, c->mon->mx + c->mon->mw, c->y);
+                sendmove(s, m->mx + m->mw, s->y);
             }
-        } else if (monitor_count > 2) {
+        } else if (moncount > 2) {
             // 超过2个时（假定为3个），左边窗口的mon藏在左边，右边窗口的mon藏在右边，中间窗口的mon藏在下边
-            if (c->mon->mx == 0) {
-                XMoveWindow(dpy, c->win, c->mon->mw * -1, c->y);
-            } else if (c->mon->mx == maxmx) {
-                XMoveWindow(dpy, c->win, c->mon->mx + c->mon->mw, c->y);
+            if (m->mx == 0) {
+                sendmove(s, m->mw * -1, s->y);
+            } else if (m->mx == monmaxx) {
+                sendmove(s, m->mx + m->mw, s->y);
             } else {
                 // 中间窗口 将窗口藏到monitor下面
                 // 如果client超过了边界，藏到所有monitor的下面，避免有一半出现在其他屏幕上
-                XMoveWindow(dpy, c->win, c->x, c->x < c->mon->mx || c->x + c->x+c->w > c->mon->mx + c->mon->mw ? maxmb : c->mon->my + c->mon->mh);
+                sendmove(s, s->x, s->x < m->mx || s->x + s->x+s->w > m->mx + m->mw ? monmaxb : m->my + m->mh);
             }
         }
     }
@@ -2671,7 +3381,7 @@ void
 tag(const Arg *arg)
 {
     if (selmon->sel && !selmon->sel->isglobal && arg->ui & TAGMASK) {
-        selmon->sel->tags = arg->ui & TAGMASK;
+        retag(selmon->sel, arg->ui & TAGMASK, 0, selmon->sel->isurgent);
         focus(NULL);
         arrange(selmon);
         view(&(Arg) { .ui = arg->ui });
@@ -2700,6 +3410,8 @@ togglesystray()
         XUnmapWindow(dpy, systray->win);
     } else {
         showsystray = 1;
+        if (systray)
+            systray->w = 0; /* never a laid out width, updatesystray() maps it again */
     }
     updatesystray();
     updatestatus();
@@ -2721,6 +3433,7 @@ togglebar(const Arg *arg)
                 wc.y = selmon->mh - bh;
         }
         XConfigureWindow(dpy, systray->win, CWY, &wc);
+        systray->y = wc.y;
     }
     arrange(selmon);
     updatesystray();
@@ -2759,20 +3472,20 @@ toggleallfloating(const Arg *arg)
     if (!selmon->sel || selmon->sel->isfullscreen)
         return;
 
-    for (c = selmon->clients; c; c = c->next)
-        if (ISVISIBLE(c) && !HIDDEN(c) && c->isfloating) {
+    for (c = visible(selmon); c; c = c->vnext)
+        if (!HIDDEN(c) && c->isfloating) {
             somefloating = 1;
             break;
         }
 
     if (somefloating) {
-        for (c = selmon->clients; c; c = c->next)
-            if (ISVISIBLE(c) && !HIDDEN(c))
+        for (c = visible(selmon); c; c = c->vnext)
+            if (!HIDDEN(c))
                 c->isfloating = 0;
         arrange(selmon);
     } else {
-        for (c = selmon->clients; c; c = c->next)
-            if (ISVISIBLE(c) && !HIDDEN(c)) {
+        for (c = visible(selmon); c; c = c->vnext)
+            if (!HIDDEN(c)) {
                 c->isfloating = 1;
                 resize(c, c->x + 2 * snap, c->y + 2 * snap, MAX(c->w - 4 * snap, snap) , MAX(c->h - 4 * snap, snap), 0);
             }
@@ -2810,13 +3523,10 @@ restorewin(const Arg *arg) {
     int i = hiddenWinStackTop;
     while (i > -1) {
         if (HIDDEN(hiddenWinStack[i]) && ISVISIBLE(hiddenWinStack[i])) {
-            show(hiddenWinStack[i]);
-            focus(hiddenWinStack[i]);
+            Client *c = hiddenWinStack[i];
+            show(c); // show removes c from hiddenWinStack
+            focus(c);
             restack(selmon);
-            // need set j<hiddenWinStackTop+1. Because show will reduce hiddenWinStackTop value.
-            for (int j = i; j < hiddenWinStackTop+1; ++j) {
-                hiddenWinStack[j] = hiddenWinStack[j + 1];
-            }
             return;
         }
         --i;
@@ -2836,8 +3546,8 @@ issinglewin(const Arg *arg) {
     Client *c = NULL;
     int cot = 0;
 
-    for (c = selmon->clients; c; c = c->next) {
-        if (ISVISIBLE(c) && !HIDDEN(c))
+    for (c = visible(selmon); c; c = c->vnext) {
+        if (!HIDDEN(c))
             cot++;
         if (cot > 1)
             return 0;
@@ -2878,8 +3588,8 @@ toggleglobal(const Arg *arg)
         return;
     if (selmon->sel->isscratchpad) // is scratchpad always global
         return;
-    selmon->sel->isglobal ^= 1;
-    selmon->sel->tags = selmon->sel->isglobal ? TAGMASK : selmon->tagset[selmon->seltags];
+    Client *c = selmon->sel;
+    retag(c, !c->isglobal ? TAGMASK : selmon->tagset[selmon->seltags], !c->isglobal, c->isurgent);
     focus(NULL);
 }
 
@@ -2892,8 +3602,8 @@ toggleborder(const Arg *arg)
     if (!selmon->sel)
         return;
     // 判断是否只有一个窗口
-    for (c = selmon->clients; c; c = c->next) {
-        if (ISVISIBLE(c) && !HIDDEN(c)) {
+    for (c = visible(selmon); c; c = c->vnext) {
+        if (!HIDDEN(c)) {
             client_count ++;
         }
     }
@@ -2932,19 +3642,23 @@ unmanage(Client *c, int destroyed)
 {
     Monitor *m = c->mon;
     XWindowChanges wc;
+    unsigned long first;
 
     detach(c);
     detachstack(c);
+    pophidden(c);
+    unregwin(c->win);
+    unregwin(c->preview.win);
     if (!destroyed) {
         wc.border_width = c->oldbw;
         XGrabServer(dpy); /* avoid race conditions */
-        XSetErrorHandler(xerrordummy);
+        first = NextRequest(dpy);
         XConfigureWindow(dpy, c->win, CWBorderWidth, &wc); /* restore border */
         XUngrabButton(dpy, AnyButton, AnyModifier, c->win);
         setclientstate(c, WithdrawnState);
-        XSync(dpy, False);
-        XSetErrorHandler(xerror);
+        trackreqs(first, "unmanage", 1); /* the window may be gone already */
         XUngrabServer(dpy);
+        XFlush(dpy);
     }
     free(c);
     focus(NULL);
@@ -2994,11 +3708,14 @@ updatebars(void)
         m->barwin = XCreateWindow(dpy, root, m->wx, m->by, m->ww, bh, 0, depth,
                 InputOutput, visual,
                 CWOverrideRedirect|CWBackPixel|CWBorderPixel|CWColormap|CWEventMask, &wa);
+        regwin(m->barwin, WinBar, m);
+        m->barbuf = drw_buf_create(drw, m->ww, bh);
         XDefineCursor(dpy, m->barwin, cursor[CurNormal]->cursor);
         if (showsystray && m == systraytomon(m))
             XMapRaised(dpy, systray->win);
         XMapRaised(dpy, m->barwin);
         XSetClassHint(dpy, m->barwin, &ch);
+        invalidatestack(m);
     }
 }
 
@@ -3033,6 +3750,7 @@ int
 updategeom(void)
 {
     int dirty = 0;
+    Monitor *mon;
 
 #ifdef XINERAMA
     if (XineramaIsActive(dpy)) {
@@ -3076,7 +3794,7 @@ updategeom(void)
                 for (m = mons; m && m->next; m = m->next);
                 while ((c = m->clients)) {
                     dirty = 1;
-                    m->clients = c->next;
+                    detach(c);
                     detachstack(c);
                     c->mon = mons;
                     attach(c);
@@ -3104,6 +3822,11 @@ updategeom(void)
         selmon = mons;
         selmon = wintomon(root);
     }
+    for (moncount = monmaxx = monmaxb = 0, mon = mons; mon; mon = mon->next) {
+        moncount++;
+        monmaxx = MAX(monmaxx, mon->mx);
+        monmaxb = MAX(monmaxb, mon->my + mon->mh);
+    }
     return dirty;
 }
 
@@ -3132,46 +3855,143 @@ updatesizehints(Client *c)
     if (!XGetWMNormalHints(dpy, c->win, &size, &msize))
         /* size is uninitialized, ensure that size.flags aren't used */
         size.flags = PSize;
-    if (size.flags & PBaseSize) {
-        c->basew = size.base_width;
-        c->baseh = size.base_height;
-    } else if (size.flags & PMinSize) {
-        c->basew = size.min_width;
-        c->baseh = size.min_height;
+    setsizehints(c, &size);
+}
+
+void
+setsizehints(Client *c, XSizeHints *size)
+{
+    if (size->flags & PBaseSize) {
+        c->basew = size->base_width;
+        c->baseh = size->base_height;
+    } else if (size->flags & PMinSize) {
+        c->basew = size->min_width;
+        c->baseh = size->min_height;
     } else
         c->basew = c->baseh = 0;
-    if (size.flags & PResizeInc) {
-        c->incw = size.width_inc;
-        c->inch = size.height_inc;
+    if (size->flags & PResizeInc) {
+        c->incw = size->width_inc;
+        c->inch = size->height_inc;
     } else
         c->incw = c->inch = 0;
-    if (size.flags & PMaxSize) {
-        c->maxw = size.max_width;
-        c->maxh = size.max_height;
+    if (size->flags & PMaxSize) {
+        c->maxw = size->max_width;
+        c->maxh = size->max_height;
     } else
         c->maxw = c->maxh = 0;
-    if (size.flags & PMinSize) {
-        c->minw = size.min_width;
-        c->minh = size.min_height;
-    } else if (size.flags & PBaseSize) {
-        c->minw = size.base_width;
-        c->minh = size.base_height;
+    if (size->flags & PMinSize) {
+        c->minw = size->min_width;
+        c->minh = size->min_height;
+    } else if (size->flags & PBaseSize) {
+        c->minw = size->base_width;
+        c->minh = size->base_height;
     } else
         c->minw = c->minh = 0;
-    if (size.flags & PAspect) {
-        c->mina = (float)size.min_aspect.y / size.min_aspect.x;
-        c->maxa = (float)size.max_aspect.x / size.max_aspect.y;
+    if (size->flags & PAspect) {
+        c->mina = (float)size->min_aspect.y / size->min_aspect.x;
+        c->maxa = (float)size->max_aspect.x / size->max_aspect.y;
     } else
         c->maxa = c->mina = 0.0;
     c->isfixed = (c->maxw && c->maxh && c->maxw == c->minw && c->maxh == c->minh);
 }
 
+// 比较两个文本块: 0 相同, 1 宽度相同内容不同, 2 宽度不同
+int
+blockcmp(const StatusBlock *a, const StatusBlock *b)
+{
+    if (a->w != b->w)
+        return 2;
+    return strcmp(a->text, b->text) || a->fg.pixel != b->fg.pixel || a->bg.pixel != b->bg.pixel;
+}
+
+// 将stext解析为文本块(颜色、信号、宽度)，绘制与点击时直接复用
+// 解析到另一块缓冲并切换，返回上一帧以供比较
+const StatusFrame *
+parsestatus(void)
+{
+    const StatusFrame *old = status;
+    char *p, *code, buf8[8], buf5[5];
+    const char *signal = "";
+    Clr fg = scheme[SchemeNorm][ColFg], bg = scheme[SchemeNorm][ColBg];
+    unsigned int textsalpha;
+    StatusBlock *b;
+    int i, isfg;
+
+    status = &statusbuf[status == &statusbuf[0]];
+    statusserial++;
+    memcpy(status->text, stext, sizeof stext);
+    status->n = status->w = 0;
+    status->nhits = -1;
+    p = status->text;
+    while (*p) {
+        if ((code = strchr(p, '^')))
+            *code = '\0';
+        if (*p && status->n < LENGTH(status->blocks)) {
+            b = &status->blocks[status->n++];
+            b->text = p;
+            b->signal = signal;
+            b->w = TEXTW(p) - lrpad;
+            b->fg = fg;
+            b->bg = bg;
+            status->w += b->w;
+        }
+        if (!code)
+            break;
+
+        /* process code */
+        for (p = code + 1; *p && *p != '^'; p++) {
+            if (*p == 'c' || *p == 'b') {
+                isfg = *p == 'c';
+                for (i = 0; i < 7 && p[1]; i++)
+                    buf8[i] = *++p;
+                buf8[i] = '\0';
+
+                textsalpha = alphas[SchemeStatusText][isfg ? ColFg : ColBg];
+                if (p[1] && p[1] != '^') {
+                    for (i = 0; i < 4 && p[1]; i++)
+                        buf5[i] = *++p;
+                    buf5[i] = '\0';
+                    textsalpha = strtoul(buf5, NULL, 16);
+                }
+                *(isfg ? &fg : &bg) = *drw_clr_get(drw, buf8, textsalpha);
+            } else if (*p == 's') {
+                signal = p + 1;
+                while (p[1] && p[1] != '^') p++;
+            } else if (*p == 'd') {
+                fg = scheme[SchemeNorm][ColFg];
+                bg = scheme[SchemeNorm][ColBg];
+            }
+        }
+        if (*p)
+            *p++ = '\0';
+    }
+    return old;
+}
+
 void
 updatestatus(void)
 {
     Monitor *m;
+    const StatusFrame *old;
+    int i, diff;
+
     if (!gettextprop(root, XA_WM_NAME, stext, sizeof(stext)))
         strcpy(stext, "^c#2D1B46^^b#335566^:) ^d^"); // 默认的状态栏文本
+    old = parsestatus();
+    for (i = 0, diff = old->n != status->n ? 2 : 0; i < status->n && diff < 2; i++)
+        diff = MAX(diff, blockcmp(&status->blocks[i], &old->blocks[i]));
+    if (!diff) // 内容未变化
+        return;
+    if (diff == 1) { // 布局未变化，只重绘变化的块
+        for (m = mons; m; m = m->next)
+            if (!m->showbar || (m->dirty & DirtyBar))
+                continue;
+            else if (statusx(m) + 1 < m->barleft) // 左侧内容压在状态栏上，只能整体重绘
+                drawbar(m);
+            else
+                drawstatusblocks(m, old);
+        return;
+    }
     for (m = mons; m; m = m->next)
         drawbar(m);
     updatesystray();
@@ -3181,6 +4001,7 @@ void
 updatesystrayicongeom(Client *i, int w, int h)
 {
     if (i) {
+        systray->iconsw = -1;
         i->h = bh;
         if (w == h)
             i->w = bh;
@@ -3237,6 +4058,8 @@ updatesystray(void)
     Monitor *m = systraytomon(NULL);
     unsigned int x = m->mx + m->mw;
     unsigned int w = 1;
+    unsigned long first = NextRequest(dpy);
+    int changed = 0;
 
     if (!showsystray)
         return;
@@ -3265,27 +4088,43 @@ updatesystray(void)
             return;
         }
     }
+    // 仅对位置、大小变化或新加入的图标发出请求
     for (w = 0, i = systray->icons; i; i = i->next) {
-        /* make sure the background color stays the same */
-        wa.background_pixel  = scheme[SchemeSystray][ColBg].pixel;
-        XChangeWindowAttributes(dpy, i->win, CWBackPixel, &wa);
-        XMapRaised(dpy, i->win);
         w += systrayspacing;
         i->x = w;
-        XMoveResizeWindow(dpy, i->win, i->x + 3, 0 + 3, MAX(i->w - 6, bh - 6), bh - 6); // 限制过大的图标
+        if (i->iconx != i->x || i->iconw != i->w || i->iconh != bh) {
+            /* make sure the background color stays the same */
+            wa.background_pixel  = scheme[SchemeSystray][ColBg].pixel;
+            XChangeWindowAttributes(dpy, i->win, CWBackPixel, &wa);
+            if (!i->iconh)
+                XMapRaised(dpy, i->win);
+            XMoveResizeWindow(dpy, i->win, i->x + 3, 0 + 3, MAX(i->w - 6, bh - 6), bh - 6); // 限制过大的图标
+            i->iconx = i->x;
+            i->iconw = i->w;
+            i->iconh = bh;
+            changed = 1;
+        }
         w += MAX(i->w, bh);
         if (i->mon != m)
             i->mon = m;
     }
     w = w ? w + systrayspacing : 1;
     x -= w;
-    XMoveResizeWindow(dpy, systray->win, x - sp, m->by + vp, w, bh);
-    wc.x = x - sp; wc.y = m->by + vp; wc.width = w; wc.height = bh;
-    wc.stack_mode = Above; wc.sibling = m->barwin;
-    XConfigureWindow(dpy, systray->win, CWX|CWY|CWWidth|CWHeight|CWSibling|CWStackMode, &wc);
+    if (systray->x != x - sp || systray->y != m->by + vp || systray->w != w || systray->sibling != m->barwin) {
+        wc.x = systray->x = x - sp;
+        wc.y = systray->y = m->by + vp;
+        wc.width = systray->w = w;
+        wc.height = bh;
+        wc.stack_mode = Above; wc.sibling = systray->sibling = m->barwin;
+        XConfigureWindow(dpy, systray->win, CWX|CWY|CWWidth|CWHeight|CWSibling|CWStackMode, &wc);
+        changed = 1;
+    }
+    if (!changed)
+        return;
     XMapWindow(dpy, systray->win);
     XMapSubwindows(dpy, systray->win);
-    XSync(dpy, False);
+    trackreqs(first, "updatesystray", 0);
+    XFlush(dpy);
 }
 
 void
@@ -3300,9 +4139,12 @@ updatetitle(Client *c)
 void
 updatewindowtype(Client *c)
 {
-    Atom state = getatomprop(c, netatom[NetWMState]);
-    Atom wtype = getatomprop(c, netatom[NetWMWindowType]);
+    setwindowtype(c, getatomprop(c, netatom[NetWMState]), getatomprop(c, netatom[NetWMWindowType]));
+}
 
+void
+setwindowtype(Client *c, Atom state, Atom wtype)
+{
     if (state == netatom[NetWMFullscreen])
         setfullscreen(c, 1);
     if (wtype == netatom[NetWMWindowTypeDialog])
@@ -3315,19 +4157,25 @@ updatewmhints(Client *c)
     XWMHints *wmh;
 
     if ((wmh = XGetWMHints(dpy, c->win))) {
-        if (c == selmon->sel && wmh->flags & XUrgencyHint) {
-            wmh->flags &= ~XUrgencyHint;
-            XSetWMHints(dpy, c->win, wmh);
-        } else
-            c->isurgent = (wmh->flags & XUrgencyHint) ? 1 : 0;
-        if (wmh->flags & InputHint)
-            c->neverfocus = !wmh->input;
-        else
-            c->neverfocus = 0;
+        setwmhints(c, wmh);
         XFree(wmh);
     }
 }
 
+void
+setwmhints(Client *c, XWMHints *wmh)
+{
+    if (c == selmon->sel && wmh->flags & XUrgencyHint) {
+        wmh->flags &= ~XUrgencyHint;
+        XSetWMHints(dpy, c->win, wmh);
+    } else
+        retag(c, c->tags, c->isglobal, (wmh->flags & XUrgencyHint) ? 1 : 0);
+    if (wmh->flags & InputHint)
+        c->neverfocus = !wmh->input;
+    else
+        c->neverfocus = 0;
+}
+
 void
 setgap(const Arg *arg)
 {
@@ -3386,41 +4234,30 @@ view(const Arg *arg)
 
 void
 viewtoleft(const Arg *arg) {
-    unsigned int target = selmon->tagset[selmon->seltags], pre;
-    Client *c;
-    while (1) {
-        pre = target;
-        target >>= 1;
-        if (target == pre) return;
-
-        for (c = selmon->clients; c; c = c->next) {
-            if (c->isglobal && c->tags == TAGMASK) continue;
-            if (c->tags & target && __builtin_popcount(selmon->tagset[selmon->seltags] & TAGMASK) == 1
-                    && selmon->tagset[selmon->seltags] > 1) {
-                view(&(Arg) { .ui = target });
-                return;
-            }
+    unsigned int target = selmon->tagset[selmon->seltags], occ;
+
+    if (__builtin_popcount(target & TAGMASK) != 1 || target <= 1)
+        return;
+    occ = occupied(selmon) | (selmon->pertag->nalltags ? TAGMASK : 0);
+    while ((target >>= 1))
+        if (occ & target) {
+            view(&(Arg) { .ui = target });
+            return;
         }
-    }
 }
 
 void
 viewtoright(const Arg *arg) {
-    unsigned int target = selmon->tagset[selmon->seltags];
-    Client *c;
-    while (1) {
-        target = target == 0 ? 1 : target << 1;
-        if (!(target & TAGMASK)) return;
-
-        for (c = selmon->clients; c; c = c->next) {
-            if (c->isglobal && c->tags == TAGMASK) continue;
-            if (c->tags & target && __builtin_popcount(selmon->tagset[selmon->seltags] & TAGMASK) == 1
-                    && selmon->tagset[selmon->seltags] & (TAGMASK >> 1)) {
-                view(&(Arg) { .ui = target });
-                return;
-            }
+    unsigned int target = selmon->tagset[selmon->seltags], occ;
+
+    if (__builtin_popcount(target & TAGMASK) != 1 || !(target & (TAGMASK >> 1)))
+        return;
+    occ = occupied(selmon) | (selmon->pertag->nalltags ? TAGMASK : 0);
+    while ((target <<= 1) & TAGMASK)
+        if (occ & target) {
+            view(&(Arg) { .ui = target });
+            return;
         }
-    }
 }
 
 void
@@ -3429,7 +4266,7 @@ tile(Monitor *m)
     unsigned int i, n, mw, mh, sh, my, sy; // mw: master的宽度, mh: master的高度, sh: stack的高度, my: master的y坐标, sy: stack的y坐标
     Client *c;
 
-    for (n = 0, c = nexttiled(m->clients); c; c = nexttiled(c->next), n++);
+    for (n = 0, c = nexttiled(visible(m)); c; c = nexttiled(c->vnext), n++);
     if (n == 0) return;
 
     if (n > m->nmaster)
@@ -3440,7 +4277,7 @@ tile(Monitor *m)
     mh = m->nmaster == 0 ? 0 : (m->wh - 2 * gappo - gappi * (m->nmaster - 1)) / m->nmaster;           // 单个master的高度
     sh = n == m->nmaster ? 0 : (m->wh - 2 * gappo - gappi * (n - m->nmaster - 1)) / (n - m->nmaster); // 单个stack的高度
 
-    for (i = 0, my = sy = gappo, c = nexttiled(m->clients); c; c = nexttiled(c->next), i++)
+    for (i = 0, my = sy = gappo, c = nexttiled(visible(m)); c; c = nexttiled(c->vnext), i++)
         if (i < m->nmaster) {
             resize(c,
                    m->wx + gappo,
@@ -3475,10 +4312,10 @@ grid(Monitor *m, uint gappo, uint gappi)
     unsigned int cols, rows, overcols;
     Client *c;
 
-    for (n = 0, c = nexttiled(m->clients); c; c = nexttiled(c->next), n++);
+    for (n = 0, c = nexttiled(visible(m)); c; c = nexttiled(c->vnext), n++);
     if (n == 0) return;
     if (n == 1) {
-        c = nexttiled(m->clients);
+        c = nexttiled(visible(m));
         cw = (m->ww - 2 * gappo) * 0.7;
         ch = (m->wh - 2 * gappo) * 0.65;
         resize(c,
@@ -3490,7 +4327,7 @@ grid(Monitor *m, uint gappo, uint gappi)
         return;
     }
     if (n == 2) {
-        c = nexttiled(m->clients);
+        c = nexttiled(visible(m));
         cw = (m->ww - 2 * gappo - gappi) / 2;
         ch = (m->wh - 2 * gappo) * 0.65;
         resize(c,
@@ -3499,7 +4336,7 @@ grid(Monitor *m, uint gappo, uint gappi)
                cw - 2 * c->bw,
                ch - 2 * c->bw,
                0);
-        resize(nexttiled(c->next),
+        resize(nexttiled(c->vnext),
                m->mx + cw + gappo + gappi,
                m->my + (m->mh - ch) / 2 + gappo,
                cw - 2 * c->bw,
@@ -3517,7 +4354,7 @@ grid(Monitor *m, uint gappo, uint gappi)
 
     overcols = n % cols;
     if (overcols) dx = (m->ww - overcols * cw - (overcols - 1) * gappi) / 2 - gappo;
-	for (i = 0, c = nexttiled(m->clients); c; c = nexttiled(c->next), i++) {
+	for (i = 0, c = nexttiled(visible(m)); c; c = nexttiled(c->vnext), i++) {
         cx = m->wx + (i % cols) * (cw + gappi);
         cy = m->wy + (i / cols) * (ch + gappi);
         if (overcols && i >= n - overcols) {
@@ -3532,27 +4369,99 @@ grid(Monitor *m, uint gappo, uint gappi)
 	}
 }
 
-Client *
-wintoclient(Window w)
+static size_t
+winhash(Window w)
 {
-    Client *c;
-    Monitor *m;
+    unsigned long h = w;
 
-    for (m = mons; m; m = m->next)
-        for (c = m->clients; c; c = c->next)
-            if (c->win == w)
-                return c;
+    h ^= h >> 16;
+    h *= 0x45d9f3bUL;
+    h ^= h >> 16;
+    return h & (wintabsize - 1);
+}
+
+static void
+growwintab(void)
+{
+    WinEntry *old = wintab;
+    size_t i, n = wintabsize;
+
+    wintabsize = n ? n * 2 : 64;
+    wintab = ecalloc(wintabsize, sizeof(WinEntry));
+    wintabused = 0;
+    for (i = 0; i < n; i++)
+        if (old[i].win)
+            regwin(old[i].win, old[i].kind, old[i].p);
+    free(old);
+}
+
+void
+regwin(Window w, int kind, void *p)
+{
+    size_t i;
+
+    if (!w)
+        return;
+    if ((wintabused + 1) * 2 > wintabsize)
+        growwintab();
+    for (i = winhash(w); wintab[i].win && wintab[i].win != w; i = (i + 1) & (wintabsize - 1));
+    if (!wintab[i].win)
+        wintabused++;
+    wintab[i].win = w;
+    wintab[i].kind = kind;
+    wintab[i].p = p;
+}
+
+void
+unregwin(Window w)
+{
+    size_t i, j, k, mask = wintabsize - 1;
+
+    if (!w || !wintabsize)
+        return;
+    for (i = winhash(w); wintab[i].win != w; i = (i + 1) & mask)
+        if (!wintab[i].win)
+            return;
+    /* backward shift deletion, so probe sequences never need tombstones */
+    for (j = i;;) {
+        wintab[i].win = None;
+        do {
+            j = (j + 1) & mask;
+            if (!wintab[j].win) {
+                wintabused--;
+                return;
+            }
+            k = winhash(wintab[j].win);
+        } while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+        wintab[i] = wintab[j];
+        i = j;
+    }
+}
+
+void *
+lookupwin(Window w, int kind)
+{
+    size_t i;
+
+    if (!w || !wintabsize)
+        return NULL;
+    for (i = winhash(w); wintab[i].win; i = (i + 1) & (wintabsize - 1))
+        if (wintab[i].win == w)
+            return wintab[i].kind == kind ? wintab[i].p : NULL;
     return NULL;
 }
 
 Client *
-wintosystrayicon(Window w) {
-    Client *i = NULL;
+wintoclient(Window w)
+{
+    return lookupwin(w, WinClient);
+}
 
+Client *
+wintosystrayicon(Window w) {
     if (!showsystray || !w)
-        return i;
-    for (i = systray->icons; i && i->win != w; i = i->next) ;
-    return i;
+        return NULL;
+    return lookupwin(w, WinSystrayIcon);
 }
 
 Monitor *
@@ -3564,20 +4473,54 @@ wintomon(Window w)
 
     if (w == root && getrootptr(&x, &y))
         return recttomon(x, y, 1, 1);
-    for (m = mons; m; m = m->next)
-        if (w == m->barwin)
-            return m;
+    if ((m = lookupwin(w, WinBar)))
+        return m;
     if ((c = wintoclient(w)))
         return c->mon;
     return selmon;
 }
 
+/* Hot paths no longer XSync, so their errors arrive later. Remember which
+ * operation issued which request serials, so xerror() can still tell whose
+ * error it is without a round trip. */
+void
+trackreqs(unsigned long first, const char *op, int ignore)
+{
+    ReqSpan *rs;
+
+    if (NextRequest(dpy) == first)
+        return;
+    rs = &reqspans[reqspanpos++ % LENGTH(reqspans)];
+    rs->first = first;
+    rs->last = NextRequest(dpy) - 1;
+    rs->op = op;
+    rs->ignore = ignore;
+}
+
+const ReqSpan *
+reqspan(unsigned long serial)
+{
+    unsigned int i;
+    ReqSpan *rs;
+
+    for (i = 1; i <= LENGTH(reqspans); i++) {
+        rs = &reqspans[(reqspanpos - i) % LENGTH(reqspans)];
+        if (rs->op && rs->first <= serial && serial <= rs->last)
+            return rs;
+    }
+    return NULL;
+}
+
 /* There's no way to check accesses to destroyed windows, thus those cases are
  * ignored (especially on UnmapNotify's). Other types of errors call Xlibs
  * default error handler, which may call exit. */
 int
 xerror(Display *dpy, XErrorEvent *ee)
 {
+    const ReqSpan *rs = reqspan(ee->serial);
+
+    if (rs && rs->ignore)
+        return 0;
     if (ee->error_code == BadWindow
             || (ee->request_code == X_SetInputFocus && ee->error_code == BadMatch)
             || (ee->request_code == X_PolyText8 && ee->error_code == BadDrawable)
@@ -3588,8 +4531,8 @@ xerror(Display *dpy, XErrorEvent *ee)
             || (ee->request_code == X_GrabKey && ee->error_code == BadAccess)
             || (ee->request_code == X_CopyArea && ee->error_code == BadDrawable))
         return 0;
-    fprintf(stderr, "dwm: fatal error: request code=%d, error code=%d\n",
-            ee->request_code, ee->error_code);
+    fprintf(stderr, "dwm: fatal error: request code=%d, error code=%d%s%s\n",
+            ee->request_code, ee->error_code, rs ? ", issued by " : "", rs ? rs->op : "");
     return xerrorxlib(dpy, ee); /* may call exit */
 }
 
@@ -3668,8 +4611,8 @@ zoom(const Arg *arg)
 
     if (c && (c->isfloating || c->isfullscreen))
         return;
-    if (c == nexttiled(selmon->clients))
-        if (!c || !(c = nexttiled(c->next)))
+    if (c == nexttiled(visible(selmon)))
+        if (!c || !(c = nexttiled(c->vnext)))
             return;
     pop(c);
 }
@@ -3712,19 +4655,14 @@ previewallwin() {
             break;
         }
         if (event.type == EnterNotify) {
-            for (c = m->clients; c; c = c->next)
-                if (event.xcrossing.window == c->preview.win) {
-                    focus_c = c;
-                    XSetWindowBorder(dpy, c->preview.win, scheme[SchemeSel][ColBorder].pixel);
-                    break;
-                }
+            if ((c = lookupwin(event.xcrossing.window, WinPreview)) && c->mon == m) {
+                focus_c = c;
+                XSetWindowBorder(dpy, c->preview.win, scheme[SchemeSel][ColBorder].pixel);
+            }
         }
         if (event.type == LeaveNotify) {
-            for (c = m->clients; c; c = c->next)
-                if (event.xcrossing.window == c->preview.win) {
-                    XSetWindowBorder(dpy, c->preview.win, scheme[SchemeNorm][ColBorder].pixel);
-                    break;
-                }
+            if ((c = lookupwin(event.xcrossing.window, WinPreview)) && c->mon == m)
+                XSetWindowBorder(dpy, c->preview.win, scheme[SchemeNorm][ColBorder].pixel);
         }
     }
 
@@ -3743,6 +4681,7 @@ focuspreviewwin(Client *focus_c, Monitor *m) {
         }
         if (c->preview.scaled_image) XDestroyImage(c->preview.scaled_image);
     }
+    invalidatestack(m); /* the clients were mapped again on top */
 
     if (focus_c) {
         show(focus_c);
@@ -3796,8 +4735,10 @@ setpreviewwins(unsigned int n, Monitor *m, unsigned int gappo, unsigned int gapp
 
 
     for (Client *c = m->clients; c; c = c->next) {
-        if (!c->preview.win) c->preview.win = XCreateSimpleWindow(dpy, root, c->preview.x, c->preview.y, c->preview.scaled_image->width, c->preview.scaled_image->height, 1, BlackPixel(dpy, screen), WhitePixel(dpy, screen));
-        else XMoveResizeWindow(dpy, c->preview.win, c->preview.x, c->preview.y, c->preview.scaled_image->width, c->preview.scaled_image->height);
+        if (!c->preview.win) {
+            c->preview.win = XCreateSimpleWindow(dpy, root, c->preview.x, c->preview.y, c->preview.scaled_image->width, c->preview.scaled_image->height, 1, BlackPixel(dpy, screen), WhitePixel(dpy, screen));
+            regwin(c->preview.win, WinPreview, c);
+        } else XMoveResizeWindow(dpy, c->preview.win, c->preview.x, c->preview.y, c->preview.scaled_image->width, c->preview.scaled_image->height);
         XSetWindowBorder(dpy, c->preview.win, scheme[SchemeNorm][ColBorder].pixel);
         XUnmapWindow(dpy, c->win);
         if (c->preview.win) {
@@ -3870,6 +4811,7 @@ main(int argc, char *argv[])
         fputs("warning: no locale support\n", stderr);
     if (!(dpy = XOpenDisplay(NULL)))
         die("dwm: cannot open display");
+    xcon = XGetXCBConnection(dpy);
     checkotherwm();
     setup();
 #ifdef __OpenBSD__
@@ -3885,9 +4827,8 @@ main(int argc, char *argv[])
 }
 
 Client *direction_select(const Arg *arg) {
-    Client *tempClients[100];
-    Client *c = NULL, *tc = selmon->sel;
-    int last = -1, issingle = issinglewin(NULL);
+    Client *c = NULL, *t, *tc = selmon->sel;
+    int issingle = issinglewin(NULL);
 
     if (tc && tc->isfullscreen) /* no support for focusstack with fullscreen windows */
         return NULL;
@@ -3896,14 +4837,6 @@ Client *direction_select(const Arg *arg) {
     if (!tc)
         return NULL;
 
-    for (c = selmon->clients; c; c = c->next) {
-        if (ISVISIBLE(c) && (issingle || !HIDDEN(c))) {
-            last ++;
-            tempClients[last] = c;
-        }
-    }
-
-    if (last < 0) return NULL;
     int sel_x=tc->x;
     int sel_y=tc->y;
     long long int distance=LLONG_MAX;
@@ -3911,29 +4844,33 @@ Client *direction_select(const Arg *arg) {
 
     switch (arg->i) {
     case UP:
-        for (int _i = 0; _i <= last; _i++) {
-            if (tempClients[_i]->y < sel_y && tempClients[_i]->x == sel_x) {
-                int dis_x = tempClients[_i]->x - sel_x;
-                int dis_y = tempClients[_i]->y - sel_y;
+        for (t = visible(selmon); t; t = t->vnext) {
+            if (!cyclable(t, issingle))
+                continue;
+            if (t->y < sel_y && t->x == sel_x) {
+                int dis_x = t->x - sel_x;
+                int dis_y = t->y - sel_y;
                 long long int tmp_distance =
                     dis_x * dis_x + dis_y * dis_y; // 计算距离
                 if (tmp_distance < distance) {
                     distance = tmp_distance;
-                    tempFocusClients = tempClients[_i];
+                    tempFocusClients = t;
                 }
             }
         }
         if (!tempFocusClients) {
             distance = LLONG_MAX;
-            for (int _i = 0; _i <= last; _i++) {
-                if (tempClients[_i]->y < sel_y) {
-                    int dis_x = tempClients[_i]->x - sel_x;
-                    int dis_y = tempClients[_i]->y - sel_y;
+            for (t = visible(selmon); t; t = t->vnext) {
+                if (!cyclable(t, issingle))
+                    continue;
+                if (t->y < sel_y) {
+                    int dis_x = t->x - sel_x;
+                    int dis_y = t->y - sel_y;
                     long long int tmp_distance =
                         dis_x * dis_x + dis_y * dis_y; // 计算距离
                     if (tmp_distance < distance) {
                         distance = tmp_distance;
-                        tempFocusClients = tempClients[_i];
+                        tempFocusClients = t;
                     }
                 }
             }
@@ -3944,29 +4881,33 @@ Client *direction_select(const Arg *arg) {
         }
         break;
     case DOWN:
-        for (int _i = 0; _i <= last; _i++) {
-            if (tempClients[_i]->y > sel_y && tempClients[_i]->x == sel_x) {
-                int dis_x = tempClients[_i]->x - sel_x;
-                int dis_y = tempClients[_i]->y - sel_y;
+        for (t = visible(selmon); t; t = t->vnext) {
+            if (!cyclable(t, issingle))
+                continue;
+            if (t->y > sel_y && t->x == sel_x) {
+                int dis_x = t->x - sel_x;
+                int dis_y = t->y - sel_y;
                 long long int tmp_distance =
                     dis_x * dis_x + dis_y * dis_y; // 计算距离
                 if (tmp_distance < distance) {
                     distance = tmp_distance;
-                    tempFocusClients = tempClients[_i];
+                    tempFocusClients = t;
                 }
             }
         }
         if (!tempFocusClients) {
             distance = LLONG_MAX;
-            for (int _i = 0; _i <= last; _i++) {
-                if (tempClients[_i]->y > sel_y) {
-                    int dis_x = tempClients[_i]->x - sel_x;
-                    int dis_y = tempClients[_i]->y - sel_y;
+            for (t = visible(selmon); t; t = t->vnext) {
+                if (!cyclable(t, issingle))
+                    continue;
+                if (t->y > sel_y) {
+                    int dis_x = t->x - sel_x;
+                    int dis_y = t->y - sel_y;
                     long long int tmp_distance =
                         dis_x * dis_x + dis_y * dis_y; // 计算距离
                     if (tmp_distance < distance) {
                         distance = tmp_distance;
-                        tempFocusClients = tempClients[_i];
+                        tempFocusClients = t;
                     }
                 }
             }
@@ -3977,29 +4918,33 @@ Client *direction_select(const Arg *arg) {
         }
         break;
     case LEFT:
-        for (int _i = 0; _i <= last; _i++) {
-            if (tempClients[_i]->x < sel_x && tempClients[_i]->y == sel_y) {
-                int dis_x = tempClients[_i]->x - sel_x;
-                int dis_y = tempClients[_i]->y - sel_y;
+        for (t = visible(selmon); t; t = t->vnext) {
+            if (!cyclable(t, issingle))
+                continue;
+            if (t->x < sel_x && t->y == sel_y) {
+                int dis_x = t->x - sel_x;
+                int dis_y = t->y - sel_y;
                 long long int tmp_distance =
                     dis_x * dis_x + dis_y * dis_y; // 计算距离
                 if (tmp_distance < distance) {
                     distance = tmp_distance;
-                    tempFocusClients = tempClients[_i];
+                    tempFocusClients = t;
                 }
             }
         }
         if (!tempFocusClients) {
             distance = LLONG_MAX;
-            for (int _i = 0; _i <= last; _i++) {
-                if (tempClients[_i]->x < sel_x) {
-                    int dis_x = tempClients[_i]->x - sel_x;
-                    int dis_y = tempClients[_i]->y - sel_y;
+            for (t = visible(selmon); t; t = t->vnext) {
+                if (!cyclable(t, issingle))
+                    continue;
+                if (t->x < sel_x) {
+                    int dis_x = t->x - sel_x;
+                    int dis_y = t->y - sel_y;
                     long long int tmp_distance =
                         dis_x * dis_x + dis_y * dis_y; // 计算距离
                     if (tmp_distance < distance) {
                         distance = tmp_distance;
-                        tempFocusClients = tempClients[_i];
+                        tempFocusClients = t;
                     }
                 }
             }
@@ -4010,31 +4955,35 @@ Client *direction_select(const Arg *arg) {
         }
         break;
     case RIGHT:
-        for (int _i = 0; _i <= last; _i++) {
+        for (t = visible(selmon); t; t = t->vnext) {
+            if (!cyclable(t, issingle))
+                continue;
             // 第一步先筛选出右边的窗口 优先选择同一层次的
-            if (tempClients[_i]->x > sel_x && tempClients[_i]->y == sel_y) {
-                int dis_x = tempClients[_i]->x - sel_x;
-                int dis_y = tempClients[_i]->y - sel_y;
+            if (t->x > sel_x && t->y == sel_y) {
+                int dis_x = t->x - sel_x;
+                int dis_y = t->y - sel_y;
                 long long int tmp_distance =
                     dis_x * dis_x + dis_y * dis_y; // 计算距离
                 if (tmp_distance < distance) {
                     distance = tmp_distance;
-                    tempFocusClients = tempClients[_i];
+                    tempFocusClients = t;
                 }
             }
         }
         // 没筛选到,再去除同一层次的要求,重新筛选
         if (!tempFocusClients) {
             distance = LLONG_MAX;
-            for (int _i = 0; _i <= last; _i++) {
-                if (tempClients[_i]->x > sel_x) {
-                    int dis_x = tempClients[_i]->x - sel_x;
-                    int dis_y = tempClients[_i]->y - sel_y;
+            for (t = visible(selmon); t; t = t->vnext) {
+                if (!cyclable(t, issingle))
+                    continue;
+                if (t->x > sel_x) {
+                    int dis_x = t->x - sel_x;
+                    int dis_y = t->y - sel_y;
                     long long int tmp_distance =
                         dis_x * dis_x + dis_y * dis_y; // 计算距离
                     if (tmp_distance < distance) {
                         distance = tmp_distance;
-                        tempFocusClients = tempClients[_i];
+                        tempFocusClients = t;
                     }
                 }
             }
@@ -4066,74 +5015,41 @@ void focusdir(const Arg *arg) {
 }
 
 void exchange_two_client(Client *c1, Client *c2) {
-    if (c1 == NULL || c2 == NULL || c1->mon != c2->mon) {
+    if (c1 == NULL || c2 == NULL || c1 == c2 || c1->mon != c2->mon) {
         return;
     }
 
-    // 先找c1的上一个节点
-    Client head1;
-    Client *headp1 = &head1;
-    headp1->next = selmon->clients;
-    Client *tmp1 = headp1;
-    for (; tmp1 != NULL; tmp1 = tmp1->next) {
-        if (tmp1->next != NULL) {
-            if (tmp1->next == c1)
-                break;
-        } else {
-            break;
-        }
-    }
+    Client *a = c1, *b = c2, *p, *n;
+    Monitor *m = c1->mon;
 
-    // 再找c2的上一个节点
-    Client head2;
-    Client *headp2 = &head2;
-    headp2->next = selmon->clients;
-    Client *tmp2 = headp2;
-    for (; tmp2 != NULL; tmp2 = tmp2->next) {
-        if (tmp2->next != NULL) {
-            if (tmp2->next == c2)
-                break;
-        } else {
-            break;
-        }
+    // 保证相邻时a在b前面
+    if (b->next == a) {
+        a = c2;
+        b = c1;
     }
-
-    if (tmp1 == NULL) { /* gDebug("tmp1==null"); */
-        return;
-    }
-    if (tmp2 == NULL) { /*  gDebug("tmp2==null"); */
-        return;
-    }
-    if (tmp1->next == NULL) { /*  gDebug("tmp1->next==null"); */
-        return;
-    }
-    if (tmp2->next == NULL) { /* gDebug("tmp2->next==null");  */
-        return;
-    }
-
-    // 当c1和c2为相邻节点时
-    if (c1->next == c2) {
-        c1->next = c2->next;
-        c2->next = c1;
-        tmp1->next = c2;
-    } else if (c2->next == c1) {
-        c2->next = c1->next;
-        c1->next = c2;
-        tmp2->next = c1;
+    if (a->next == b) {
+        p = a->prev;
+        n = b->next;
+        b->prev = p;
+        b->next = a;
+        a->prev = b;
+        a->next = n;
     } else { // 不为相邻节点
-        tmp1->next = c2;
-        tmp2->next = c1;
-        Client *tmp = c1->next;
-        c1->next = c2->next;
-        c2->next = tmp;
+        p = a->prev;
+        n = a->next;
+        a->prev = b->prev;
+        a->next = b->next;
+        b->prev = p;
+        b->next = n;
     }
-
-    // 当更换节点为头节点时，重置头节点
-    if (c1 == selmon->clients) {
-        selmon->clients = c2;
-    } else if (c2 == selmon->clients) {
-        selmon->clients = c1;
+    // 修正两个节点前后邻居的指针及头尾节点
+    for (p = a; p; p = p == a ? b : NULL) {
+        if (p->prev) p->prev->next = p;
+        else m->clients = p;
+        if (p->next) p->next->prev = p;
+        else m->ctail = p;
     }
+    m->visok = 0;
 
     focus(c1);
     arrange(c1->mon);
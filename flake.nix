@@ -38,7 +38,7 @@
           packages.dwm = pkgs.dwm;
           packages.default = pkgs.dwm;
           devShells.default = pkgs.mkShell {
-            buildInputs = with pkgs; [ xorg.libX11 xorg.libXft xorg.libXinerama gcc ];
+            buildInputs = with pkgs; [ xorg.libX11 xorg.libxcb xorg.libXft xorg.libXinerama gcc ];
           };
         }
       )